@@ -5,7 +5,7 @@ sudo -v
 BUILDROOT_DIR="buildroot/buildroot-2018.08/"
 IMAGES_DIR="$BUILDROOT_DIR/output/images"
 TARGET_DIR="$BUILDROOT_DIR/output/target"
-HEADERS_DIR="$BUILDROOT_DIR/output/build/linux-4.17.19"
+HEADERS_DIR="$BUILDROOT_DIR/output/build/linux-5.15.167"
 HEADERS_ABS="$(realpath $HEADERS_DIR)"
 export HEADERS
 
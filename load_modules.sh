@@ -2,5 +2,12 @@
 
 
 modprobe rc-core
-insmod output/xbox_remote_keymap.ko
+
+# Optional: overrides the keymap built into xbox_remote.ko, must be
+# loaded first to be picked up by probe
+if [ -f output/xbox_remote_keymap.ko ];
+then
+    insmod output/xbox_remote_keymap.ko
+fi
+
 insmod output/xbox_remote.ko
@@ -0,0 +1,155 @@
+#!/bin/sh
+#
+# Generate the built-in keymaps of xbox_remote from keymaps/*.map
+#
+#   gen_keymaps.sh <keymaps dir> <output header>
+#
+# Each <variant>.map becomes
+#   xbox_keys_<variant>[]   rc_map_table sorted by scancode
+#   xbox_map_<variant>      rc_map_list registered by the driver
+# and xbox_generated_maps[] lists all of them. XBOX_GENERATED_VARIANTS(V)
+# expands V(<variant>) for every map and XBOX_GENERATED_DEVICES(D)
+# expands D(<vendor>, <product>, <variant>) for every usb line, so a new
+# receiver only needs a new map file.
+#
+# The build fails on a malformed line, a scancode outside 0x00-0xff, a
+# scancode mapped twice, a map missing one of the REQUIRED keys or
+# without a usb line, or a usb id claimed by two maps.
+
+REQUIRED="KEY_UP KEY_DOWN KEY_LEFT KEY_RIGHT KEY_ENTER KEY_BACK
+KEY_0 KEY_1 KEY_2 KEY_3 KEY_4 KEY_5 KEY_6 KEY_7 KEY_8 KEY_9"
+
+dir="$1"
+out="$2"
+
+if [ -z "$dir" ] || [ -z "$out" ];
+then
+    echo "usage: $0 <keymaps dir> <output header>" >&2
+    exit 1
+fi
+
+tmp="$out.tmp"
+trap 'rm -f "$tmp" "$tmp.keys" "$tmp.devices"' EXIT
+: > "$tmp.devices"
+
+{
+    echo "/* Generated by gen_keymaps.sh from keymaps/*.map, do not edit */"
+    echo
+} > "$tmp"
+
+variants=""
+
+for map in "$dir"/*.map;
+do
+    variant=$(basename "$map" .map)
+
+    # Validate and normalise to "scancode keycode" with decimal scancodes
+    awk -v file="$map" -v required="$REQUIRED" '
+        function fail(msg) {
+            printf("%s:%d: %s\n", file, NR, msg) > "/dev/stderr"
+            failed = 1
+            exit 1
+        }
+        /^[ \t]*(#|$)/ { next }
+        $1 == "name" {
+            if (NF != 2)
+                fail("expected: name <rc map name>")
+            name = $2
+            next
+        }
+        $1 == "usb" {
+            if (NF != 3 || $2 !~ /^0[xX][0-9a-fA-F]+$/ || length($2) != 6 ||
+                $3 !~ /^0[xX][0-9a-fA-F]+$/ || length($3) != 6)
+                fail("expected: usb <0xvendor> <0xproduct>")
+            usb[++nusb] = tolower($2) " " tolower($3)
+            next
+        }
+        {
+            if (NF != 2 || $1 !~ /^0[xX][0-9a-fA-F]+$/ || $2 !~ /^KEY_[A-Z0-9_]+$/)
+                fail("expected: <0xscancode> <KEY_xxx>")
+            code = 0
+            hex = tolower(substr($1, 3))
+            for (i = 1; i <= length(hex); i++)
+                code = code * 16 + index("0123456789abcdef", substr(hex, i, 1)) - 1
+            if (code > 255)
+                fail("scancode " $1 " does not fit in one byte")
+            if (code in seen)
+                fail("scancode " $1 " already mapped to " seen[code])
+            seen[code] = $2
+            keys[$2] = 1
+            print code, $2
+        }
+        END {
+            if (failed)
+                exit 1
+            if (name == "")
+                fail("missing name line")
+            if (!nusb)
+                fail("missing usb line")
+            n = split(required, req, /[ \t\n]+/)
+            for (i = 1; i <= n; i++)
+                if (req[i] != "" && !(req[i] in keys))
+                    fail("required key " req[i] " is not mapped")
+            print "name", name
+            for (i = 1; i <= nusb; i++)
+                print "usb", usb[i]
+        }
+    ' "$map" > "$tmp.keys" || exit 1
+
+    name=$(awk '$1 == "name" { print $2 }' "$tmp.keys")
+    awk -v variant="$variant" '$1 == "usb" { print $2, $3, variant }' \
+        "$tmp.keys" >> "$tmp.devices"
+
+    {
+        echo "static struct rc_map_table xbox_keys_$variant[] = {"
+        grep -Ev '^(name|usb) ' "$tmp.keys" | sort -n | \
+            awk '{ printf("    { 0x%02x, %s },\n", $1, $2) }'
+        echo "};"
+        echo
+        echo "static struct rc_map_list xbox_map_$variant = {"
+        echo "    .map = {"
+        echo "        .scan     = xbox_keys_$variant,"
+        echo "        .size     = ARRAY_SIZE(xbox_keys_$variant),"
+        echo "        .rc_proto = RC_PROTO_OTHER,"
+        echo "        .name     = \"$name\","
+        echo "    }"
+        echo "};"
+        echo
+    } >> "$tmp"
+
+    variants="$variants $variant"
+done
+
+if [ -z "$variants" ];
+then
+    echo "$0: no keymaps in $dir" >&2
+    exit 1
+fi
+
+dup=$(awk '{ print $1, $2 }' "$tmp.devices" | sort | uniq -d | head -n 1)
+if [ -n "$dup" ];
+then
+    echo "$0: usb id $dup is claimed by more than one map" >&2
+    exit 1
+fi
+
+{
+    echo "static struct rc_map_list *xbox_generated_maps[] = {"
+    for variant in $variants;
+    do
+        echo "    &xbox_map_$variant,"
+    done
+    echo "};"
+    echo
+    echo "#define XBOX_GENERATED_VARIANTS(V) \\"
+    for variant in $variants;
+    do
+        echo "    V($variant) \\"
+    done
+    echo
+    echo "#define XBOX_GENERATED_DEVICES(D) \\"
+    awk '{ printf("    D(%s, %s, %s) \\\n", $1, $2, $3) }' "$tmp.devices"
+    echo
+} >> "$tmp"
+
+mv "$tmp" "$out"
@@ -47,34 +47,199 @@
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/usb/input.h>
+#include <linux/version.h>
 #include <linux/wait.h>
+#include <linux/spinlock.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/atomic.h>
+#include <linux/jump_label.h>
+#include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/sched.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/pm_runtime.h>
+#include <linux/dmapool.h>
+#include <linux/usb/hcd.h>
+#include <linux/filter.h>
+#include <linux/capability.h>
+#include <linux/compat.h>
 #include <media/rc-core.h>
+
+/* bpf_prog_run() is the newest interface the driver needs */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+#error "xbox_remote needs Linux 5.15 or later"
+#endif
+
 #include "xbox_remote_keymap.h"
+#include "xbox_remote_ring.h"
+#include "xbox_remote_keymaps.h"
+
+#define CREATE_TRACE_POINTS
+#include "xbox_remote_trace.h"
 
 /*
  * Module and Version Information, Module Parameters
  */
 
- /* USB vendor ids for XBOX DVD Dongles */
-#define VENDOR_MS1      0x040b
-#define VENDOR_MS2      0x045e
-#define VENDOR_MS3      0xFFFF
-
 #define DRIVER_VERSION          "1.0"
 #define DRIVER_AUTHOR           "Giovanni Tarter <giovanni.tarter@gmail.com>"
 #define DRIVER_DESC             "XBox DVD Remote"
 
 #define NAME_BUFSIZE      80    /* size of product name, path buffers */
 #define DATA_BUFSIZE      63    /* size of URB data buffers */
+#define MAX_URBS          8     /* upper bound for num_urbs */
+#define DEFAULT_URBS      4
+
+/*
+ * The last two bytes of a packet look like a clock. On dongles where it
+ * identifies the press (constant while a key is held, different for the
+ * next press) it tells a new press from a repeat at once. Whether it
+ * does is learnt from the first CLOCK_SAMPLES packets the time window
+ * heuristic classifies, held or not; up to 1/CLOCK_MISS_RATIO of them may
+ * disagree (quick presses of the same key look like repeats to the
+ * heuristic). A constant byte agrees with every repeat, so the clock must
+ * also have changed on at least CLOCK_PRESSES new presses.
+ */
+#define CLOCK_SAMPLES     32
+#define CLOCK_MISS_RATIO  8
+#define CLOCK_PRESSES     4
+
+/*
+ * Filter calibration.
+ * Dongles differ in the spacing of their packets and in the number of
+ * duplicates a single press generates, so FILTER_TIME and REPEAT_DELAY
+ * are worst case values. Each device measures the gaps between packets
+ * of a held key and the packet count of its first CALIB_PRESSES presses,
+ * then derives its own release timeout (longest gap + 50%) and autorepeat
+ * delay (typical single press burst + release timeout + CALIB_MARGIN).
+ * The results are cached by USB path and reused when the device comes back.
+ */
+#define CALIB_PRESSES     16
+#define CALIB_MIN_GAPS    32
+#define CALIB_MAX_BURST   16    /* longer presses are holds, not bursts */
+#define CALIB_MARGIN      50    /* msec */
+#define FILTER_MIN        20    /* msec */
+
+/*
+ * Urb error recovery.
+ * A few isolated errors are retried at once. After ERR_RETRY errors in a
+ * row, or on a stall, the ring is left idle and a work item restarts it
+ * (clearing the halt first for stalls, resetting the device if that
+ * fails). Each restart that does not bring a good packet doubles the
+ * delay, from BACKOFF_MIN up to max_backoff, so a failing receiver
+ * cannot keep the completion handler spinning.
+ */
+#define ERR_RETRY         3
+#define BACKOFF_MIN       8     /* msec */
+#define BACKOFF_MAX       1000  /* msec */
+
+/*
+ * Threaded mode.
+ * The completion handler only stamps the packet, queues it in a
+ * single-producer single-consumer kfifo and resubmits the urb; a per
+ * device kthread runs the filter and reports to rc-core. The thread
+ * only takes key_lock, which the completion handler then never needs.
+ */
+#define FIFO_PACKETS      64    /* power of 2 */
+#define PACKET_BYTES      8
+
+struct xbox_packet {
+    ktime_t stamp;              /* urb completion time */
+    u8 len;
+    u8 data[PACKET_BYTES];
+};
+
+enum xbox_clock_mode {
+    CLOCK_LEARNING,
+    CLOCK_USABLE,
+    CLOCK_UNUSABLE,
+};
+
+enum xbox_gesture_state {
+    GESTURE_IDLE,
+    GESTURE_PRESSED,            /* held, long press timer running */
+    GESTURE_RELEASED,           /* tapped once, waiting for the second */
+    GESTURE_DONE,               /* sent, waiting for the release */
+};
+
+/*
+ * Aggregates.
+ * Receivers covering the same room can be combined into one logical
+ * remote with an input device of its own. Each receiver still filters
+ * its own packets; when one of them sees a new press, the aggregate
+ * checks its AGGREGATE_PRESSES most recent presses for the same scancode
+ * and clock within aggregate_window, and only the first receiver to
+ * report a press sends it.
+ */
+#define AGGREGATE_WINDOW  100
+#define AGGREGATE_PRESSES 8
+
+/*
+ * Repeat policy of a scancode. Defaults follow the keycode, sysfs can
+ * override them per scancode.
+ *   normal    input autorepeat after REP_DELAY
+ *   norepeat  one keydown/keyup pair per press, however long it is held
+ *   fast      repeats every REP_PERIOD from repeat_fast_delay on
+ *   bypass    every packet of the hold repeats from repeat_fast_delay on,
+ *             earlier packets are the duplicates of a single press
+ * fast and bypass repeats stop when input autorepeat takes over.
+ */
+#define XBOX_POLICY_NORMAL    0
+#define XBOX_POLICY_NOREPEAT  1
+#define XBOX_POLICY_FAST      2
+#define XBOX_POLICY_BYPASS    3
+
+#define REPEAT_FAST_DELAY 150
+
+/*
+ * Acceleration.
+ * With accel set, a held key with the fast policy steps instead of
+ * repeating: a keydown/keyup pair every accel_period divided by the
+ * factor of the profile, which grows with the hold time like the accel[]
+ * table of ati_remote. With accel_pointer, arrow keys move a pointer
+ * device every ACCEL_POINTER_PERIOD by the factor instead.
+ */
+#define XBOX_POLICY_ACCEL     4   /* fast key held with accel, never stored */
+
+#define ACCEL_STEPS           8
+#define ACCEL_PERIOD          200
+#define ACCEL_POINTER_PERIOD  20
+
+/*
+ * Gestures.
+ * A scancode with a long press or double tap keycode is held back from
+ * the input device. Holding it for gesture_long sends the long press
+ * keycode, pressing it again within gesture_double of the release sends
+ * the double tap keycode, anything else sends its own keycode as a tap
+ * once the outcome is known. Gesture keycodes are limited to KEY_MACRO1
+ * to KEY_MACRO30 and the keys of the built-in keymaps, which every input
+ * device of a receiver declares before it is registered.
+ */
+#define GESTURE_LONG    600
+#define GESTURE_DOUBLE  300
 
 /*
  * Duplicate event filtering time.
- * Sequential, identical KIND_FILTERED inputs with less than
- * FILTER_TIME milliseconds between them are considered as repeat
- * events. The hardware generates 5 events for the first keypress
- * and we have to take this into account for an accurate repeat
- * behaviour.
+ * Sequential, identical inputs with less than FILTER_TIME milliseconds
+ * between them belong to the same held key. The hardware generates 5
+ * events for a single keypress (less than 75 msec apart) and keeps
+ * sending them while the key is held; the key is released once no
+ * packet has arrived for FILTER_TIME. Repeats are left to input core
+ * autorepeat, which starts after REPEAT_DELAY: a single press must be
+ * released before that, so FILTER_TIME + burst length < REPEAT_DELAY.
  */
 #define FILTER_TIME 300 /* msec */
 #define REPEAT_DELAY    500 /* msec */
@@ -83,242 +248,3619 @@ static unsigned long channel_mask;
 module_param(channel_mask, ulong, 0644);
 MODULE_PARM_DESC(channel_mask, "Bitmask of remote control channels to ignore");
 
-//static int debug;
-static int debug = 1;
-module_param(debug, int, 0644);
+static unsigned long channel_devices;
+module_param(channel_devices, ulong, 0444);
+MODULE_PARM_DESC(channel_devices, "Bitmask of remote control channels reported on an input device of their own, default = 0");
+
+/*
+ * Debug output is guarded by a static key, so with debug off the packet
+ * path carries a patched-out jump instead of a test and no formatting.
+ * Writing the parameter flips the key at runtime.
+ */
+static DEFINE_STATIC_KEY_FALSE(xbox_debug_key);
+
+static int debug;
+
+static int xbox_debug_set(const char *val, const struct kernel_param *kp)
+{
+    int ret = param_set_int(val, kp);
+
+    if (ret)
+        return ret;
+
+    if (debug)
+        static_branch_enable(&xbox_debug_key);
+    else
+        static_branch_disable(&xbox_debug_key);
+
+    return 0;
+}
+
+static const struct kernel_param_ops xbox_debug_ops = {
+    .set = xbox_debug_set,
+    .get = param_get_int,
+};
+
+module_param_cb(debug, &xbox_debug_ops, &debug, 0644);
 MODULE_PARM_DESC(debug, "Enable extra debug messages and information");
 
 static int repeat_filter = FILTER_TIME;
-module_param(repeat_filter, int, 0644);
-MODULE_PARM_DESC(repeat_filter, "Repeat filter time, default = 60 msec");
+
+/* Anything shorter than FILTER_MIN splits the packets of a single press */
+static int xbox_repeat_filter_set(const char *val, const struct kernel_param *kp)
+{
+    int filter;
+    int ret = kstrtoint(val, 0, &filter);
+
+    if (ret)
+        return ret;
+    if (filter < FILTER_MIN)
+        return -EINVAL;
+
+    WRITE_ONCE(*(int *)kp->arg, filter);
+    return 0;
+}
+
+static const struct kernel_param_ops xbox_repeat_filter_ops = {
+    .set = xbox_repeat_filter_set,
+    .get = param_get_int,
+};
+
+module_param_cb(repeat_filter, &xbox_repeat_filter_ops, &repeat_filter, 0644);
+MODULE_PARM_DESC(repeat_filter, "Release a held key after this much silence, at least 20, default = 300 msec");
 
 static int repeat_delay = REPEAT_DELAY;
 module_param(repeat_delay, int, 0644);
-MODULE_PARM_DESC(repeat_delay, "Delay before sending repeats, default = 500 msec");
+MODULE_PARM_DESC(repeat_delay, "Autorepeat delay set at probe, default = 500 msec");
+
+static unsigned int repeat_fast_delay = REPEAT_FAST_DELAY;
+module_param(repeat_fast_delay, uint, 0644);
+MODULE_PARM_DESC(repeat_fast_delay, "Delay before keys with the fast or bypass policy repeat, default = 150 msec");
+
+static bool accel;
+module_param(accel, bool, 0644);
+MODULE_PARM_DESC(accel, "Accelerate held keys with the fast policy, default = N");
+
+static unsigned int accel_period = ACCEL_PERIOD;
+module_param(accel_period, uint, 0644);
+MODULE_PARM_DESC(accel_period, "Step interval of an accelerated key at factor 1, default = 200 msec");
+
+static unsigned int accel_factor[ACCEL_STEPS] = { 1, 2, 4, 6, 9, 13, 20 };
+static unsigned int accel_nfactor = 7;
+module_param_array(accel_factor, uint, &accel_nfactor, 0644);
+MODULE_PARM_DESC(accel_factor, "Speed factors of the acceleration profile, default = 1,2,4,6,9,13,20");
+
+static unsigned int accel_msecs[ACCEL_STEPS] = { 125, 250, 500, 1000, 1500, 2000 };
+static unsigned int accel_nmsecs = 6;
+module_param_array(accel_msecs, uint, &accel_nmsecs, 0644);
+MODULE_PARM_DESC(accel_msecs, "Hold time up to which each factor applies, the last factor after that, default = 125,250,500,1000,1500,2000 msec");
+
+static bool accel_pointer;
+module_param(accel_pointer, bool, 0444);
+MODULE_PARM_DESC(accel_pointer, "Move a pointer device with accelerated arrow keys, default = N");
+
+static unsigned int gesture_long = GESTURE_LONG;
+module_param(gesture_long, uint, 0644);
+MODULE_PARM_DESC(gesture_long, "Hold time of a long press, default = 600 msec");
+
+static unsigned int gesture_double = GESTURE_DOUBLE;
+module_param(gesture_double, uint, 0644);
+MODULE_PARM_DESC(gesture_double, "Time from release to the second press of a double tap, default = 300 msec");
+
+static int num_urbs = DEFAULT_URBS;
+module_param(num_urbs, int, 0444);
+MODULE_PARM_DESC(num_urbs, "Interrupt URBs kept in flight per device (1-8), default = 4");
+
+static bool use_clock = true;
+module_param(use_clock, bool, 0644);
+MODULE_PARM_DESC(use_clock, "Use the packet clock bytes to detect new presses when the dongle provides them, default = Y");
+
+static bool calibrate = true;
+module_param(calibrate, bool, 0644);
+MODULE_PARM_DESC(calibrate, "Learn repeat_filter and repeat_delay per device, default = Y");
+
+static bool threaded;
+module_param(threaded, bool, 0444);
+MODULE_PARM_DESC(threaded, "Decode packets in a per device kthread instead of the urb completion, default = N");
+
+static int thread_prio = 50;
+module_param(thread_prio, int, 0444);
+MODULE_PARM_DESC(thread_prio, "Scheduling of the decode thread: 0 SCHED_NORMAL, 1 lowest SCHED_FIFO priority, higher values SCHED_FIFO priority 50, default = 50");
+
+static int thread_cpu = -1;
+module_param(thread_cpu, int, 0444);
+MODULE_PARM_DESC(thread_cpu, "CPU the decode thread is bound to, default = -1 (any)");
+
+static bool wakeup;
+module_param(wakeup, bool, 0444);
+MODULE_PARM_DESC(wakeup, "Let a remote key press wake the system from sleep, default = N");
+
+static bool autosuspend;
+module_param(autosuspend, bool, 0444);
+MODULE_PARM_DESC(autosuspend, "Suspend an idle receiver, woken by the next key press where supported, default = N");
+
+static int autosuspend_delay = 2000;
+module_param(autosuspend_delay, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay, "Idle time before the receiver is suspended with autosuspend set, -1 never, default = 2000 msec");
+
+static unsigned int wake_budget;
+module_param(wake_budget, uint, 0644);
+MODULE_PARM_DESC(wake_budget, "Keep an open receiver awake when its average wakeup takes longer, 0 no limit, default = 0 usec");
+
+static unsigned int poll_slow;
+module_param(poll_slow, uint, 0444);
+MODULE_PARM_DESC(poll_slow, "Polling interval of an idle receiver, 0 always polls at bInterval, UHCI only, default = 0 msec");
+
+static unsigned int poll_idle = 1000;
+module_param(poll_idle, uint, 0444);
+MODULE_PARM_DESC(poll_idle, "Quiet time before an idle receiver is polled at poll_slow, default = 1000 msec");
+
+static unsigned int max_backoff = BACKOFF_MAX;
+module_param(max_backoff, uint, 0644);
+MODULE_PARM_DESC(max_backoff, "Longest delay between urb error recovery attempts, default = 1000 msec");
+
+static unsigned int ring_records;
+module_param(ring_records, uint, 0444);
+MODULE_PARM_DESC(ring_records, "Records in the mmap scancode ring of /dev/xbox_remoteN (0 = no ring, the packet filter still works, max 65536), default = 0");
+
+static char *aggregate;
+module_param(aggregate, charp, 0444);
+MODULE_PARM_DESC(aggregate, "Receivers combined into one remote, comma separated USB paths, each optionally followed by =<aggregate id> (default 1)");
+
+static unsigned int aggregate_window = AGGREGATE_WINDOW;
+module_param(aggregate_window, uint, 0644);
+MODULE_PARM_DESC(aggregate_window, "Presses of the same key and clock seen by several receivers of an aggregate within this time are one press, default = 100 msec");
 
 #define dbginfo(dev, format, arg...) \
-    do { if (debug) dev_info(dev , format , ## arg); } while (0)
+    do { if (static_branch_unlikely(&xbox_debug_key)) \
+        dev_info(dev , format , ## arg); } while (0)
 #undef err
 #define err(format, arg...) printk(KERN_ERR format , ## arg)
 
 
-static const struct usb_device_id xbox_remote_table[] = {
-    
-    
-    /* Gamester Xbox DVD Movie Playback Kit IR */
-    {
-        USB_DEVICE(VENDOR_MS1, 0x6521)
-    },
+/*
+ * Receiver variants. Each one has its own keymap, built into the driver
+ * from keymaps/<variant>.map (see gen_keymaps.sh), so probe never waits
+ * for a keymap module. A loaded rc-xbox module still overrides them.
+ * The usb lines of the map files make up the id table.
+ */
+struct xbox_remote_variant {
+    struct rc_map_list *map;
+};
+
+#define XBOX_VARIANT(name)                                              \
+static const struct xbox_remote_variant xbox_variant_##name = {         \
+    .map = &xbox_map_##name,                                            \
+};
 
-    /* Microsoft Xbox DVD Movie Playback Kit IR */
-    { 
-        USB_DEVICE(VENDOR_MS2, 0x0284)
-    }, 
+XBOX_GENERATED_VARIANTS(XBOX_VARIANT)
 
-    /*
-     * Some Chinese manufacturer -- conflicts with the joystick from the
-     * same manufacturer
-     */
-    { 
-        USB_DEVICE(VENDOR_MS3, 0xFFFF) 
+#define XBOX_DEVICE(vendor, product, name)                              \
+    {                                                                   \
+        USB_DEVICE(vendor, product),                                    \
+        .driver_info = (kernel_ulong_t)&xbox_variant_##name             \
     },
 
+static const struct usb_device_id xbox_remote_table[] = {
+    XBOX_GENERATED_DEVICES(XBOX_DEVICE)
+
     /* Terminating entry */
     { }
 };
 
 MODULE_DEVICE_TABLE(usb, xbox_remote_table);
 
-/* Get hi and low bytes of a 16-bits int */
-#define HI(a)   ((unsigned char)((a) >> 8))
-#define LO(a)   ((unsigned char)((a) & 0xff))
+/* Calibration results of a device, kept across replugs */
+struct xbox_calib_entry {
+    struct list_head list;
+    char phys[NAME_BUFSIZE];
+    u16 vendor;
+    u16 product;
+    ktime_t filter_time;
+    unsigned int rep_delay;     /* msec */
+};
+
+static LIST_HEAD(xbox_calib_cache);
+static DEFINE_MUTEX(xbox_calib_mutex);
+
+/*
+ * Latency histogram with log2 buckets: bucket 0 counts intervals below
+ * 1 usec, bucket i counts [2^(i-1), 2^i) usec and the last one
+ * everything above. Updated from the completion path without locking.
+ */
+#define HIST_BUCKETS      24
+
+/*
+ * The last MALFORMED_SLOTS malformed packets of each device are kept for
+ * debugfs. Writers claim a slot with an atomic counter and never wait;
+ * a reader racing with a writer may see a torn entry.
+ */
+#define MALFORMED_SLOTS   16
+#define MALFORMED_BYTES   8
+
+struct xbox_malformed {
+    ktime_t stamp;
+    unsigned int len;
+    u8 data[MALFORMED_BYTES];
+};
+
+struct xbox_hist {
+    atomic64_t bucket[HIST_BUCKETS];
+};
+
+static struct dentry *xbox_debugfs_root;
+
+/*
+ * Control node of a receiver, carrying the packet filter and, with
+ * ring_records, the shared memory scancode ring; see xbox_remote_ring.h.
+ * It is reference counted apart from the device because an open file or
+ * mapping may outlive a disconnect. head and mask are kept here and only
+ * published to the mapped header, the driver never trusts what the page
+ * holds.
+ */
+struct xbox_ring {
+    struct kref kref;
+    struct miscdevice misc;
+    char name[24];
+    int id;
+    wait_queue_head_t wait;
+    struct xbox_ring_header *header;    /* vmalloc_user, NULL: no ring */
+    struct xbox_ring_record *records;
+    u32 head;                           /* records written so far */
+    u32 mask;                           /* records - 1 */
+    size_t size;
+    bool dead;                          /* device gone */
+    struct bpf_prog __rcu *filter;
+    struct mutex filter_mutex;
+};
+
+static DEFINE_IDA(xbox_ring_ida);
+
+/* Enabled while any receiver has a packet filter */
+static DEFINE_STATIC_KEY_FALSE(xbox_filter_key);
+
+#define RING_MAX_RECORDS  65536U
+
+/*
+ * Remote identity.
+ * Byte 3 of a packet identifies the remote: the stock DVD kit remote
+ * always sends 0x0a, remotes set up for another channel send another
+ * value up to XBOX_CHANNELS - 1. Only the stock value is accepted
+ * unless channel_mask or channel_devices asks for channels, anything
+ * else is a malformed packet.
+ */
+#define XBOX_CHANNELS     16
+#define XBOX_STOCK_CHANNEL 0x0a
+
+/*
+ * Urb error statuses counted individually in the stats, anything else
+ * lands in the last "other" bucket.
+ */
+static const struct {
+    int status;
+    const char *name;
+} xbox_urb_errors[] = {
+    { -EPROTO,    "EPROTO" },
+    { -EILSEQ,    "EILSEQ" },
+    { -EPIPE,     "EPIPE" },
+    { -ETIME,     "ETIME" },
+    { -EOVERFLOW, "EOVERFLOW" },
+    { -EREMOTEIO, "EREMOTEIO" },
+    { -ENOSR,     "ENOSR" },
+    { -ECOMM,     "ECOMM" },
+    { 0,          "other" },
+};
+
+/*
+ * Per device counters, exported read-only in the stats group of the
+ * usb interface, /sys/class/rc/rcN/device/stats/ from the rc device.
+ * Writers never take a lock.
+ */
+struct xbox_stats {
+    atomic_long_t packets;          /* successful urbs */
+    atomic_long_t malformed_byte;   /* 1 byte packets */
+    atomic_long_t malformed_key;    /* 4 byte packets */
+    atomic_long_t malformed_data;   /* any other bad header */
+    atomic_long_t duplicates;       /* repeats before autorepeat starts */
+    atomic_long_t held;             /* repeats while autorepeat runs */
+    atomic_long_t events;           /* keydown and keyup sent */
+    atomic_long_t resubmit_errors;
+    atomic_long_t fifo_overflows;   /* threaded mode only */
+    atomic_long_t unmapped;         /* scancodes without keycode */
+    atomic_long_t recoveries;       /* ring restarts after errors */
+    atomic_long_t halts_cleared;
+    atomic_long_t resets;
+    atomic_long_t runtime_suspends;
+    atomic_long_t runtime_vetoes;   /* refused, wakeups too slow */
+    atomic_long_t suspended_usec;
+    atomic_long_t wakeups;          /* resumes on open */
+    atomic_long_t wakeup_usec;
+    atomic_long_t poll_fast_usec;   /* ring running at the fast interval */
+    atomic_long_t poll_slow_usec;
+    atomic_long_t poll_switches;    /* ring restarts at another interval */
+    atomic_long_t aggregate_first;  /* presses this receiver sent first */
+    atomic_long_t aggregate_copies; /* presses another receiver sent */
+    atomic_long_t masked;           /* packets of channels in channel_mask */
+    atomic_long_t filtered;         /* packets dropped by the packet filter */
+    atomic_long_t gesture_longs;
+    atomic_long_t gesture_doubles;
+    atomic_long_t urb_errors[ARRAY_SIZE(xbox_urb_errors)];
+    atomic_t presses[256];          /* keydowns per scancode */
+};
+
+#define xbox_stat_inc(xbox_remote, field) \
+    atomic_long_inc(&(xbox_remote)->stats.field)
+
+struct xbox_remote;
+
+/*
+ * One slot of the interrupt URB ring. Every slot owns its own coherent
+ * buffer so that a completed packet can wait for its turn to be reported
+ * while the other slots stay queued on the endpoint.
+ */
+struct xbox_remote_urb {
+    struct xbox_remote *xbox_remote;
+    struct urb *urb;
+    unsigned char *buf;
+    dma_addr_t buf_dma;
+
+    unsigned int seq;   /* submission sequence number */
+    ktime_t stamp;      /* completion time */
+    bool active;        /* submitted, or completed and not yet reported */
+    bool done;          /* completed, waiting to be reported */
+};
+
+/*
+ * Packet buffers come from a dma_pool shared by all receivers behind the
+ * same host controller, 64 bytes each, instead of a usb_alloc_coherent()
+ * per slot. A dma_pool maps for one device, so there is one pool per
+ * controller rather than one per module.
+ */
+struct xbox_buf_pool {
+    struct list_head list;
+    struct device *dev;         /* the controller doing the DMA */
+    struct dma_pool *pool;
+    unsigned int users;
+};
+
+static LIST_HEAD(xbox_buf_pools);
+static DEFINE_MUTEX(xbox_buf_pools_mutex);
+
+struct xbox_aggregate_press {
+    ktime_t stamp;
+    const struct xbox_remote *first;    /* compared, never dereferenced */
+    u16 clock;
+    u8 scancode;
+};
+
+struct xbox_aggregate {
+    struct list_head list;
+    unsigned int id;
+    unsigned int members;       /* protected by xbox_aggregates_mutex */
+    struct input_dev *idev;
+
+    struct mutex mutex;         /* receivers and opened */
+    struct list_head receivers;
+    bool opened;                /* idev open, receivers opened for it */
+    char name[NAME_BUFSIZE];
+    char phys[NAME_BUFSIZE];
+
+    spinlock_t lock;            /* recent presses */
+    struct xbox_aggregate_press recent[AGGREGATE_PRESSES];
+    unsigned int recent_next;
+};
+
+static LIST_HEAD(xbox_aggregates);
+static DEFINE_MUTEX(xbox_aggregates_mutex);
 
-#define SEND_FLAG_IN_PROGRESS   1
-#define SEND_FLAG_COMPLETE  2
+struct xbox_channel {
+    struct input_dev *idev;     /* NULL: reported on the rc device */
+    char name[NAME_BUFSIZE];
+    char phys[NAME_BUFSIZE];
+};
 
+/*
+ * Per receiver state.
+ *
+ * Footprint of a receiver on 64-bit without lock debugging:
+ *   struct xbox_remote  about 6 KiB: stats with the press counters
+ *                       (1.3 KiB), six histograms (1.1 KiB), gesture
+ *                       tables (1 KiB), keycode table (512 bytes), urb
+ *                       ring (450 bytes), malformed packets (384 bytes)
+ *                       and device names (320 bytes)
+ *   urbs                num_urbs x about 200 bytes
+ *   packet buffers      num_urbs x 64 bytes from the shared pool
+ *   decode fifo         1.5 KiB, threaded mode only
+ *   scancode ring       one page + ring_records x 16 bytes, ring only
+ * plus the rc and input devices allocated by rc-core.
+ */
 struct xbox_remote {
+    spinlock_t ring_lock;
+    unsigned int num_urbs;
+    unsigned int ring_head;     /* next slot to report */
+    unsigned int submit_seq;
+    unsigned int report_seq;    /* seq expected at ring_head */
+
+    spinlock_t key_lock;        /* key filter state, nests in ring_lock */
+    unsigned int repeat_count;
+    enum xbox_clock_mode clock_mode;
+    unsigned int held_keycode;
+    ktime_t old_time;           /* last packet of the held key */
+    ktime_t first_time;         /* first packet of the held key */
+    u16 old_clock;              /* clock bytes of the last packet */
+    unsigned char old_data;     /* Detect duplicate events */
+    bool key_held;
+    bool key_suppressed;        /* no keyup due, sent elsewhere or tapped */
+    u8 old_channel;
+    struct input_dev *held_idev;    /* NULL: held key went through rc-core */
+
     struct rc_dev *rdev;
     struct usb_device *udev;
     struct usb_interface *interface;
 
-    struct urb *irq_urb;
     struct usb_endpoint_descriptor *endpoint_in;
-    unsigned char *inbuf;
-    dma_addr_t inbuf_dma;
 
-    unsigned char old_data;     /* Detect duplicate events */
-    unsigned long old_jiffies;
-    unsigned long acc_jiffies;  /* handle acceleration */
-    unsigned long first_jiffies;
+    struct xbox_remote_urb ring[MAX_URBS];
+    struct xbox_buf_pool *buf_pool;     /* NULL: usb_alloc_coherent() */
 
-    unsigned int repeat_count;
+    unsigned int clock_samples;
+    unsigned int clock_misses;
+    unsigned int clock_presses;     /* new presses that changed the clock */
+
+    bool calibrated;
+    ktime_t filter_time;        /* learnt release timeout */
+    unsigned int rep_delay;     /* learnt autorepeat delay, msec */
+    ktime_t gap_max;
+    u64 gap_sum;                /* nsec */
+    unsigned int gap_count;
+    unsigned int presses;
+    u8 burst_hist[CALIB_MAX_BURST + 1];
 
+    struct dentry *debugfs;
+    struct xbox_hist report_hist;   /* urb completion to rc_keydown */
+    struct xbox_hist gap_hist;      /* consecutive packets, same scancode */
+    struct xbox_hist hold_hist;     /* first to last packet of a press */
+    struct xbox_hist recovery_hist; /* first error to next good packet */
+    struct xbox_hist wakeup_hist;   /* resume of a suspended receiver on open */
+    struct xbox_hist copy_hist;     /* first receiver to this one, same press */
+
+    struct xbox_malformed malformed[MALFORMED_SLOTS];
+    atomic_t malformed_next;
+
+    struct xbox_stats stats;
+    struct hrtimer release_timer;
+
+    wait_queue_head_t wait;     /* decode thread */
+    struct task_struct *thread;
+    DECLARE_KFIFO_PTR(fifo, struct xbox_packet);
+
+    struct xbox_ring *scan_ring;
+
+    /*
+     * Scancodes are one byte, so the current keymap is mirrored in a
+     * direct-indexed table, refreshed whenever the keymap changes. It
+     * drops unmapped scancodes before any rc-core work and gives the
+     * keycode to the repeat policies and to the devices reported on
+     * without rc-core. Keys of the rc device still go through
+     * rc_keydown(), whose own lookup keeps rc-core's keyup, LED and
+     * last key state right.
+     */
+    u16 keycodes[256];
+
+    /*
+     * Repeat policy of each scancode, two bits split over two bitmaps
+     * so that both change with atomic bit operations.
+     */
+    DECLARE_BITMAP(policy_lo, 256);
+    DECLARE_BITMAP(policy_hi, 256);
+    DECLARE_BITMAP(policy_set, 256);    /* from sysfs, kept over keymap changes */
+    unsigned int held_policy;
+    struct hrtimer repeat_timer;
+
+    /*
+     * Gesture keycodes of each scancode, 0 for none, and the state of
+     * the one gesture in progress, protected by key_lock.
+     */
+    u16 gesture_long_keys[256];
+    u16 gesture_double_keys[256];
+    struct hrtimer gesture_timer;
+    ktime_t gesture_deadline;
+    enum xbox_gesture_state gesture_state;
+    unsigned char gesture_scancode;
+    unsigned int gesture_keycode;
+    struct input_dev *gesture_idev;
+
+    int (*rc_setkeycode)(struct input_dev *idev,
+                         const struct input_keymap_entry *ke,
+                         unsigned int *old_keycode);
+
+    int users;  /* opened rc, channel and pointer devices, and the aggregate */
+    struct mutex open_mutex;
+
+    /* Error recovery, protected by ring_lock */
+    struct delayed_work recover_work;
+    unsigned int err_streak;    /* errors since the last good packet */
+    unsigned int backoff;       /* msec */
+    bool recovering;            /* ring idle until recover_work runs */
+    bool halted;                /* endpoint stalled */
+    ktime_t fault_start;        /* 0 when healthy */
+
+    bool suspended;             /* protected by open_mutex */
+    ktime_t suspend_start;
+
+    /*
+     * Adaptive polling, protected by open_mutex. The completion path only
+     * reads poll_fast and poll_slow_ms and updates last_packet under
+     * ring_lock.
+     */
+    struct delayed_work poll_work;
+    unsigned int poll_fast_ms;
+    unsigned int poll_slow_ms;  /* 0 never slows down */
+    unsigned int poll_idle_ms;
+    unsigned int poll_interval; /* urb->interval the ring runs at */
+    bool poll_fixed;            /* the hcd ignores urb->interval */
+    bool poll_fast;
+    ktime_t poll_start;         /* 0 while the ring is stopped */
+    ktime_t last_packet;
+
+    /* Changed under key_lock, with no key held */
+    struct xbox_aggregate *aggregate;
+    struct list_head aggregate_node;    /* protected by aggregate->mutex */
+    bool aggregate_open;                /* opened for the aggregate */
+
+    /* Per channel input devices, NULL without channel_devices */
+    struct xbox_channel *channels;
+
+    /* Moved by accelerated arrow keys, NULL without accel_pointer */
+    struct input_dev *pointer;
+    char pointer_name[NAME_BUFSIZE];
+    char pointer_phys[NAME_BUFSIZE];
+
+    /* Identification, only read by rc-core */
     char rc_name[NAME_BUFSIZE];
     char rc_phys[NAME_BUFSIZE];
+};
+
+
+/*
+ * xbox_remote_dump_input
+ *
+ * Record a malformed packet; print it only in debug mode, rate limited.
+ */
+static void xbox_remote_dump(struct xbox_remote *xbox_remote,
+                unsigned char *data, unsigned int len, ktime_t stamp)
+{
+    struct device *dev = &xbox_remote->udev->dev;
+    struct xbox_malformed *m;
+    unsigned int slot;
+
+    slot = (unsigned int)atomic_inc_return(&xbox_remote->malformed_next) - 1;
+    m = &xbox_remote->malformed[slot % MALFORMED_SLOTS];
+    m->stamp = stamp;
+    m->len = len;
+    memcpy(m->data, data, min_t(unsigned int, len, MALFORMED_BYTES));
+
+    if (len == 1)
+        xbox_stat_inc(xbox_remote, malformed_byte);
+    else if (len == 4)
+        xbox_stat_inc(xbox_remote, malformed_key);
+    else
+        xbox_stat_inc(xbox_remote, malformed_data);
+
+    if (!static_branch_unlikely(&xbox_debug_key))
+        return;
+
+    if (len == 1) {
+        if (data[0] != (unsigned char)0xff && data[0] != 0x00)
+            dev_warn_ratelimited(dev, "Weird byte 0x%02x\n", data[0]);
+    } else if (len == 4)
+        dev_warn_ratelimited(dev, "Weird key %*ph\n", 4, data);
+    else
+        dev_warn_ratelimited(dev, "Weird data, len=%d %*ph ...\n", len,
+                             min_t(unsigned int, len, MALFORMED_BYTES), data);
+}
+
+/*
+ * xbox_remote_submit_urb
+ *
+ * Queue one ring slot on the endpoint. Must be called with ring_lock held
+ * so that sequence numbers follow the order in which the host controller
+ * sees the URBs.
+ */
+static int xbox_remote_submit_urb(struct xbox_remote_urb *ru, gfp_t mem_flags)
+{
+    struct xbox_remote *xbox_remote = ru->xbox_remote;
+    int retval;
+
+    ru->seq = xbox_remote->submit_seq++;
+    ru->done = false;
+    ru->active = true;
+
+    retval = usb_submit_urb(ru->urb, mem_flags);
+    if (retval)
+        ru->active = false;
+
+    return retval;
+}
+
+/*
+ * xbox_remote_kill_urbs
+ */
+static void xbox_remote_kill_urbs(struct xbox_remote *xbox_remote)
+{
+    unsigned int i;
+
+    for (i = 0; i < xbox_remote->num_urbs; i++)
+        usb_kill_urb(xbox_remote->ring[i].urb);
+}
+
+/*
+ * xbox_remote_start_urbs
+ *
+ * Submit the whole ring, returns the number of urbs queued. The lock
+ * keeps early completions from resubmitting a slot before the remaining
+ * ones are queued, which would break the ordering.
+ */
+static unsigned int xbox_remote_start_urbs(struct xbox_remote *xbox_remote)
+{
+    unsigned int i, submitted = 0;
+
+    spin_lock_irq(&xbox_remote->ring_lock);
+    xbox_remote->ring_head = 0;
+    xbox_remote->submit_seq = 0;
+    xbox_remote->report_seq = 0;
+
+    for (i = 0; i < xbox_remote->num_urbs; i++) {
+        struct xbox_remote_urb *ru = &xbox_remote->ring[i];
+
+        ru->urb->dev = xbox_remote->udev;
+        if (xbox_remote_submit_urb(ru, GFP_ATOMIC) == 0)
+            submitted++;
+    }
+    spin_unlock_irq(&xbox_remote->ring_lock);
+
+    return submitted;
+}
+
+/*
+ * xbox_remote_recover_work
+ *
+ * Restart an idle ring after errors. Runs in process context, so it can
+ * kill the urbs still queued and clear a halted endpoint.
+ */
+static void xbox_remote_recover_work(struct work_struct *work)
+{
+    struct xbox_remote *xbox_remote =
+        container_of(to_delayed_work(work), struct xbox_remote, recover_work);
+    struct device *dev = &xbox_remote->interface->dev;
+    unsigned int pipe;
+    bool halted;
+    int retval;
+
+    mutex_lock(&xbox_remote->open_mutex);
+    if (!xbox_remote->users || xbox_remote->suspended)
+        goto out;
+
+    xbox_remote_kill_urbs(xbox_remote);
+
+    spin_lock_irq(&xbox_remote->ring_lock);
+    halted = xbox_remote->halted;
+    xbox_remote->halted = false;
+    xbox_remote->recovering = false;
+    spin_unlock_irq(&xbox_remote->ring_lock);
+
+    if (halted) {
+        pipe = usb_rcvintpipe(xbox_remote->udev,
+                              xbox_remote->endpoint_in->bEndpointAddress);
+        retval = usb_clear_halt(xbox_remote->udev, pipe);
+        if (retval) {
+            dev_err(dev, "%s: usb_clear_halt()=%d, resetting\n",
+                __func__, retval);
+            xbox_stat_inc(xbox_remote, resets);
+            usb_queue_reset_device(xbox_remote->interface);
+            goto out;
+        }
+        xbox_stat_inc(xbox_remote, halts_cleared);
+    }
+
+    xbox_stat_inc(xbox_remote, recoveries);
+    if (!xbox_remote_start_urbs(xbox_remote))
+        dev_err(dev, "%s: usb_submit_urb failed!\n", __func__);
+
+out:
+    mutex_unlock(&xbox_remote->open_mutex);
+}
+
+/*
+ * xbox_remote_poison_urbs
+ *
+ * Kill the ring for good: recover_work can no longer resubmit it.
+ */
+static void xbox_remote_poison_urbs(struct xbox_remote *xbox_remote)
+{
+    unsigned int i;
+
+    for (i = 0; i < xbox_remote->num_urbs; i++)
+        usb_poison_urb(xbox_remote->ring[i].urb);
+}
+
+static void xbox_remote_key_release(struct xbox_remote *xbox_remote,
+                ktime_t stamp);
+static void xbox_remote_gesture_flush(struct xbox_remote *xbox_remote,
+                ktime_t stamp);
+static void xbox_hist_add(struct xbox_hist *hist, ktime_t delta);
+
+/*
+ * xbox_remote_poll_account
+ *
+ * Add the time since the last switch to the counter of the current
+ * polling mode. Called with open_mutex held.
+ */
+static void xbox_remote_poll_account(struct xbox_remote *xbox_remote,
+                ktime_t now)
+{
+    s64 usec;
+
+    if (!xbox_remote->poll_start)
+        return;
+
+    usec = ktime_us_delta(now, xbox_remote->poll_start);
+    if (xbox_remote->poll_fast)
+        atomic_long_add(usec, &xbox_remote->stats.poll_fast_usec);
+    else
+        atomic_long_add(usec, &xbox_remote->stats.poll_slow_usec);
+    xbox_remote->poll_start = now;
+}
+
+/*
+ * xbox_remote_poll_interval
+ *
+ * urb->interval of a polling mode as usb_submit_urb programs it: frames
+ * on full and low speed, microframes on high speed, rounded down to a
+ * power of two and capped at 128 frames or 1024 microframes. Called with
+ * open_mutex held.
+ */
+static unsigned int xbox_remote_poll_interval(struct xbox_remote *xbox_remote,
+                bool fast)
+{
+    unsigned int interval, max;
+
+    interval = fast ? xbox_remote->poll_fast_ms : xbox_remote->poll_slow_ms;
+    max = 128;
+    if (xbox_remote->udev->speed >= USB_SPEED_HIGH) {
+        interval *= 8;
+        max *= 8;
+    }
+
+    return min(max, 1U << ilog2(interval));
+}
+
+/*
+ * xbox_remote_poll_slows
+ *
+ * Whether an idle receiver polls at another interval than a busy one,
+ * which also takes poll_slow_ms not rounding to the same interval as
+ * poll_fast_ms. Called with open_mutex held.
+ */
+static bool xbox_remote_poll_slows(struct xbox_remote *xbox_remote)
+{
+    return xbox_remote->poll_slow_ms &&
+        xbox_remote_poll_interval(xbox_remote, false) !=
+        xbox_remote_poll_interval(xbox_remote, true);
+}
+
+/*
+ * xbox_remote_set_interval
+ *
+ * Program an interval into the stopped ring.
+ */
+static void xbox_remote_set_interval(struct xbox_remote *xbox_remote,
+                unsigned int interval)
+{
+    unsigned int i;
+
+    for (i = 0; i < xbox_remote->num_urbs; i++)
+        xbox_remote->ring[i].urb->interval = interval;
+    xbox_remote->poll_interval = interval;
+}
+
+/*
+ * xbox_remote_poll_fixed
+ *
+ * Only UHCI reserves the bandwidth of an interrupt endpoint again once
+ * its queue drains, with the interval of the next urb. EHCI and OHCI
+ * keep the period they computed for the endpoint in ep->hcpriv and xHCI
+ * schedules by bInterval, so restarting the ring with another interval
+ * only loses packets there.
+ */
+static bool xbox_remote_poll_fixed(struct usb_device *udev)
+{
+    struct usb_hcd *hcd = bus_to_hcd(udev->bus);
+
+    return strcmp(hcd->driver->description, "uhci_hcd") != 0;
+}
+
+/*
+ * xbox_remote_poll_work
+ *
+ * Poll fast while keys arrive, slowly after poll_idle_ms without a
+ * packet. The host controller schedules an interrupt endpoint when its
+ * first urb is queued, so a new interval takes a restart of the ring.
+ */
+static void xbox_remote_poll_work(struct work_struct *work)
+{
+    struct xbox_remote *xbox_remote =
+        container_of(to_delayed_work(work), struct xbox_remote, poll_work);
+    ktime_t now = ktime_get();
+    bool fast, slows, recovering;
+    unsigned int interval;
+    s64 quiet;
+
+    mutex_lock(&xbox_remote->open_mutex);
+    if (!xbox_remote->users || xbox_remote->suspended)
+        goto out;
+
+    spin_lock_irq(&xbox_remote->ring_lock);
+    quiet = ktime_ms_delta(now, xbox_remote->last_packet);
+    recovering = xbox_remote->recovering;
+    spin_unlock_irq(&xbox_remote->ring_lock);
+
+    /* recover_work restarts the ring with the current interval */
+    if (recovering)
+        goto out;
+
+    slows = xbox_remote_poll_slows(xbox_remote);
+    fast = !slows || quiet < xbox_remote->poll_idle_ms;
+    interval = xbox_remote_poll_interval(xbox_remote, fast);
+    if (!xbox_remote->poll_fixed && interval != xbox_remote->poll_interval) {
+        xbox_remote_poll_account(xbox_remote, now);
+        WRITE_ONCE(xbox_remote->poll_fast, fast);
+        xbox_remote_kill_urbs(xbox_remote);
+        xbox_remote_set_interval(xbox_remote, interval);
+        if (!xbox_remote_start_urbs(xbox_remote))
+            dev_err(&xbox_remote->interface->dev,
+                "%s: usb_submit_urb failed!\n", __func__);
+        xbox_stat_inc(xbox_remote, poll_switches);
+    }
+
+    if (fast && slows)
+        schedule_delayed_work(&xbox_remote->poll_work,
+            msecs_to_jiffies(xbox_remote->poll_idle_ms - quiet));
+
+out:
+    mutex_unlock(&xbox_remote->open_mutex);
+}
+
+/*
+ * xbox_remote_arm
+ *
+ * Reset the error state and submit the ring, starting with the slow
+ * interval when adaptive polling is on. Called with open_mutex held.
+ */
+static unsigned int xbox_remote_arm(struct xbox_remote *xbox_remote)
+{
+    bool fast = !xbox_remote_poll_slows(xbox_remote);
+
+    WRITE_ONCE(xbox_remote->poll_fast, fast);
+    xbox_remote_set_interval(xbox_remote,
+                             xbox_remote_poll_interval(xbox_remote, fast));
+    xbox_remote->poll_start = ktime_get();
+
+    spin_lock_irq(&xbox_remote->ring_lock);
+    xbox_remote->err_streak = 0;
+    xbox_remote->backoff = BACKOFF_MIN;
+    xbox_remote->recovering = false;
+    xbox_remote->halted = false;
+    xbox_remote->fault_start = 0;
+    spin_unlock_irq(&xbox_remote->ring_lock);
+
+    return xbox_remote_start_urbs(xbox_remote);
+}
+
+/*
+ * xbox_remote_disarm
+ *
+ * Stop the ring and release a held key. Called with open_mutex held.
+ */
+static void xbox_remote_disarm(struct xbox_remote *xbox_remote)
+{
+    xbox_remote_kill_urbs(xbox_remote);
+    xbox_remote_poll_account(xbox_remote, ktime_get());
+    xbox_remote->poll_start = 0;
+    cancel_delayed_work(&xbox_remote->poll_work);
+    hrtimer_cancel(&xbox_remote->release_timer);
+    hrtimer_cancel(&xbox_remote->repeat_timer);
+
+    spin_lock_irq(&xbox_remote->key_lock);
+    xbox_remote_key_release(xbox_remote, ktime_get());
+    xbox_remote_gesture_flush(xbox_remote, ktime_get());
+    spin_unlock_irq(&xbox_remote->key_lock);
+    hrtimer_cancel(&xbox_remote->gesture_timer);
+}
+
+/*
+ * xbox_remote_settle
+ *
+ * Release a held key and end a gesture in progress while every input
+ * device of the receiver still exists. The urbs and the decode thread
+ * must be stopped already, so no new press or gesture can follow.
+ */
+static void xbox_remote_settle(struct xbox_remote *xbox_remote)
+{
+    spin_lock_irq(&xbox_remote->key_lock);
+    xbox_remote_key_release(xbox_remote, ktime_get());
+    xbox_remote_gesture_flush(xbox_remote, ktime_get());
+    xbox_remote->gesture_state = GESTURE_IDLE;
+    spin_unlock_irq(&xbox_remote->key_lock);
+
+    hrtimer_cancel(&xbox_remote->release_timer);
+    hrtimer_cancel(&xbox_remote->repeat_timer);
+    hrtimer_cancel(&xbox_remote->gesture_timer);
+}
+
+/*
+ * xbox_remote_open
+ *
+ * The receiver may be runtime suspended, so wake it first and time how
+ * long that takes. While open it may only autosuspend if it can wake
+ * the host on a key press.
+ */
+static int xbox_remote_open(struct xbox_remote *xbox_remote)
+{
+    struct usb_interface *interface = xbox_remote->interface;
+    bool asleep = pm_runtime_suspended(&interface->dev);
+    ktime_t start = ktime_get();
+    unsigned int submitted;
+    int err;
+
+    err = usb_autopm_get_interface(interface);
+    if (err)
+        return err;
+
+    if (asleep) {
+        ktime_t delta = ktime_sub(ktime_get(), start);
+
+        xbox_stat_inc(xbox_remote, wakeups);
+        atomic_long_add(ktime_to_us(delta), &xbox_remote->stats.wakeup_usec);
+        xbox_hist_add(&xbox_remote->wakeup_hist, delta);
+    }
+
+    mutex_lock(&xbox_remote->open_mutex);
+
+    if (xbox_remote->users++ != 0)
+        goto out; /* one was already active */
+
+    interface->needs_remote_wakeup = 1;
+    if (xbox_remote->suspended)
+        goto out; /* resume submits the ring */
+
+    /* On first open, submit the whole ring which was set up previously. */
+    submitted = xbox_remote_arm(xbox_remote);
+    if (!submitted) {
+        dev_err(&interface->dev, "%s: usb_submit_urb failed!\n", __func__);
+        interface->needs_remote_wakeup = 0;
+        xbox_remote->users--;
+        err = -EIO;
+    } else if (submitted != xbox_remote->num_urbs) {
+        dev_warn(&interface->dev, "%s: only %u of %u urbs submitted\n",
+            __func__, submitted, xbox_remote->num_urbs);
+    }
+
+out:    mutex_unlock(&xbox_remote->open_mutex);
+    usb_autopm_put_interface(interface);
+    return err;
+}
+
+/*
+ * xbox_remote_close
+ */
+static void xbox_remote_close(struct xbox_remote *xbox_remote)
+{
+    mutex_lock(&xbox_remote->open_mutex);
+    if (--xbox_remote->users == 0) {
+        xbox_remote_disarm(xbox_remote);
+        xbox_remote->interface->needs_remote_wakeup = 0;
+    }
+    mutex_unlock(&xbox_remote->open_mutex);
+}
+
+
+static int xbox_remote_rc_open(struct rc_dev *rdev)
+{
+    struct xbox_remote *xbox_remote = rdev->priv;
+    return xbox_remote_open(xbox_remote);
+}
+
+
+static void xbox_remote_rc_close(struct rc_dev *rdev)
+{
+    struct xbox_remote *xbox_remote = rdev->priv;
+    xbox_remote_close(xbox_remote);
+}
+
+
+/*
+ * xbox_hist_add
+ */
+static void xbox_hist_add(struct xbox_hist *hist, ktime_t delta)
+{
+    s64 usec = ktime_to_us(delta);
+    unsigned int i = 0;
+
+    if (usec > 0)
+        i = min_t(unsigned int, fls64(usec), HIST_BUCKETS - 1);
+
+    atomic64_inc(&hist->bucket[i]);
+}
+
+static void xbox_hist_reset(struct xbox_hist *hist)
+{
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        atomic64_set(&hist->bucket[i], 0);
+}
+
+static int xbox_hist_show(struct seq_file *m, void *unused)
+{
+    struct xbox_hist *hist = m->private;
+    unsigned int i;
+
+    seq_puts(m, "usec_from usec_to count\n");
+    for (i = 0; i < HIST_BUCKETS; i++)
+        seq_printf(m, "%llu %llu %lld\n",
+            i ? 1ULL << (i - 1) : 0ULL,
+            i < HIST_BUCKETS - 1 ? 1ULL << i : ~0ULL,
+            (long long)atomic64_read(&hist->bucket[i]));
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xbox_hist);
+
+static ssize_t xbox_hist_reset_write(struct file *file,
+                const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct xbox_remote *xbox_remote = file->private_data;
+
+    xbox_hist_reset(&xbox_remote->report_hist);
+    xbox_hist_reset(&xbox_remote->gap_hist);
+    xbox_hist_reset(&xbox_remote->hold_hist);
+    xbox_hist_reset(&xbox_remote->recovery_hist);
+    xbox_hist_reset(&xbox_remote->wakeup_hist);
+    xbox_hist_reset(&xbox_remote->copy_hist);
+
+    return count;
+}
+
+static const struct file_operations xbox_hist_reset_fops = {
+    .owner  = THIS_MODULE,
+    .open   = simple_open,
+    .write  = xbox_hist_reset_write,
+    .llseek = noop_llseek,
+};
+
+static int xbox_malformed_show(struct seq_file *m, void *unused)
+{
+    struct xbox_remote *xbox_remote = m->private;
+    unsigned int next = atomic_read(&xbox_remote->malformed_next);
+    unsigned int i, n = min_t(unsigned int, next, MALFORMED_SLOTS);
+
+    seq_printf(m, "total %u\n", next);
+    for (i = next - n; i != next; i++) {
+        struct xbox_malformed *e = &xbox_remote->malformed[i % MALFORMED_SLOTS];
+
+        seq_printf(m, "%lld len=%u %*ph\n", ktime_to_us(e->stamp), e->len,
+                   min_t(unsigned int, e->len, MALFORMED_BYTES), e->data);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xbox_malformed);
+
+/*
+ * xbox_remote_debugfs_init
+ *
+ * Creates xbox_remote/<interface>/ with one file per histogram, a
+ * write-only reset file and the recent malformed packets. Failures only
+ * cost the diagnostics.
+ */
+static void xbox_remote_debugfs_init(struct xbox_remote *xbox_remote)
+{
+    struct dentry *dir;
+
+    dir = debugfs_create_dir(dev_name(&xbox_remote->interface->dev),
+                             xbox_debugfs_root);
+    xbox_remote->debugfs = dir;
+
+    debugfs_create_file("report_latency", 0444, dir,
+                        &xbox_remote->report_hist, &xbox_hist_fops);
+    debugfs_create_file("packet_gap", 0444, dir,
+                        &xbox_remote->gap_hist, &xbox_hist_fops);
+    debugfs_create_file("hold_time", 0444, dir,
+                        &xbox_remote->hold_hist, &xbox_hist_fops);
+    debugfs_create_file("recovery_time", 0444, dir,
+                        &xbox_remote->recovery_hist, &xbox_hist_fops);
+    debugfs_create_file("wakeup_time", 0444, dir,
+                        &xbox_remote->wakeup_hist, &xbox_hist_fops);
+    debugfs_create_file("copy_lag", 0444, dir,
+                        &xbox_remote->copy_hist, &xbox_hist_fops);
+    debugfs_create_file("reset", 0200, dir, xbox_remote,
+                        &xbox_hist_reset_fops);
+    debugfs_create_file("malformed", 0444, dir, xbox_remote,
+                        &xbox_malformed_fops);
+}
+
+/*
+ * xbox_remote_filter_time
+ */
+static ktime_t xbox_remote_filter_time(struct xbox_remote *xbox_remote)
+{
+    if (calibrate && xbox_remote->calibrated)
+        return xbox_remote->filter_time;
+
+    return ms_to_ktime(READ_ONCE(repeat_filter));
+}
+
+/*
+ * xbox_remote_set_rep_delay
+ *
+ * Set the autorepeat delay of every input device the receiver reports
+ * on. Called with key_lock held.
+ */
+static void xbox_remote_set_rep_delay(struct xbox_remote *xbox_remote,
+                unsigned int delay)
+{
+    unsigned int i;
+
+    xbox_remote->rdev->input_dev->rep[REP_DELAY] = delay;
+
+    if (xbox_remote->channels)
+        for (i = 0; i < XBOX_CHANNELS; i++)
+            if (xbox_remote->channels[i].idev)
+                xbox_remote->channels[i].idev->rep[REP_DELAY] = delay;
+
+    if (xbox_remote->aggregate)
+        xbox_remote->aggregate->idev->rep[REP_DELAY] = delay;
+}
+
+/*
+ * xbox_remote_calib_finish
+ *
+ * Called with key_lock held, once enough samples are in.
+ */
+static void xbox_remote_calib_finish(struct xbox_remote *xbox_remote)
+{
+    ktime_t filter, spacing, burst;
+    unsigned int i, burst_len = 1;
+
+    for (i = 1; i <= CALIB_MAX_BURST; i++)
+        if (xbox_remote->burst_hist[i] > xbox_remote->burst_hist[burst_len])
+            burst_len = i;
+
+    filter = xbox_remote->gap_max + xbox_remote->gap_max / 2;
+    filter = clamp(filter, ms_to_ktime(FILTER_MIN),
+                   ms_to_ktime(READ_ONCE(repeat_filter)));
+
+    spacing = div_u64(xbox_remote->gap_sum, xbox_remote->gap_count);
+    burst = spacing * (burst_len - 1);
+
+    xbox_remote->filter_time = filter;
+    xbox_remote->rep_delay = min_t(unsigned int, repeat_delay,
+        ktime_to_ms(burst + filter) + CALIB_MARGIN);
+    xbox_remote->calibrated = true;
+    xbox_remote_set_rep_delay(xbox_remote, xbox_remote->rep_delay);
+
+    dev_info(&xbox_remote->interface->dev,
+        "calibrated: spacing %lld usec, burst %u packets, filter %lld usec, repeat delay %u msec\n",
+        ktime_to_us(spacing), burst_len, ktime_to_us(filter),
+        xbox_remote->rep_delay);
+}
+
+/*
+ * xbox_remote_calib_press
+ *
+ * Account a press that ended by timeout. Called with key_lock held.
+ */
+static void xbox_remote_calib_press(struct xbox_remote *xbox_remote)
+{
+    unsigned int packets = xbox_remote->repeat_count + 1;
+
+    if (!calibrate || xbox_remote->calibrated)
+        return;
+
+    if (packets <= CALIB_MAX_BURST)
+        xbox_remote->burst_hist[packets]++;
+
+    if (++xbox_remote->presses >= CALIB_PRESSES &&
+        xbox_remote->gap_count >= CALIB_MIN_GAPS)
+        xbox_remote_calib_finish(xbox_remote);
+}
+
+/*
+ * xbox_remote_calib_lookup
+ */
+static void xbox_remote_calib_lookup(struct xbox_remote *xbox_remote)
+{
+    struct usb_device *udev = xbox_remote->udev;
+    struct xbox_calib_entry *entry;
+
+    mutex_lock(&xbox_calib_mutex);
+    list_for_each_entry(entry, &xbox_calib_cache, list) {
+        if (strcmp(entry->phys, xbox_remote->rc_phys) ||
+            entry->vendor != le16_to_cpu(udev->descriptor.idVendor) ||
+            entry->product != le16_to_cpu(udev->descriptor.idProduct))
+            continue;
+
+        xbox_remote->filter_time = entry->filter_time;
+        xbox_remote->rep_delay = entry->rep_delay;
+        xbox_remote->calibrated = true;
+        break;
+    }
+    mutex_unlock(&xbox_calib_mutex);
+}
+
+/*
+ * xbox_remote_calib_store
+ */
+static void xbox_remote_calib_store(struct xbox_remote *xbox_remote)
+{
+    struct usb_device *udev = xbox_remote->udev;
+    struct xbox_calib_entry *entry;
+
+    if (!xbox_remote->calibrated)
+        return;
+
+    mutex_lock(&xbox_calib_mutex);
+    list_for_each_entry(entry, &xbox_calib_cache, list)
+        if (!strcmp(entry->phys, xbox_remote->rc_phys))
+            goto found;
+
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry)
+        goto out;
+    strscpy(entry->phys, xbox_remote->rc_phys, sizeof(entry->phys));
+    list_add(&entry->list, &xbox_calib_cache);
+
+found:
+    entry->vendor = le16_to_cpu(udev->descriptor.idVendor);
+    entry->product = le16_to_cpu(udev->descriptor.idProduct);
+    entry->filter_time = xbox_remote->filter_time;
+    entry->rep_delay = xbox_remote->rep_delay;
+out:
+    mutex_unlock(&xbox_calib_mutex);
+}
+
+/*
+ * xbox_ring_add
+ *
+ * Publish one record, if the node has a ring. Called with key_lock held,
+ * so there is a single writer; the barrier orders the record before the
+ * new head.
+ */
+static void xbox_ring_add(struct xbox_ring *ring, u8 scancode, u8 verdict,
+                unsigned int repeat_count, ktime_t stamp)
+{
+    struct xbox_ring_record *rec;
+    u32 head;
+
+    if (!ring->header)
+        return;
+
+    head = ring->head++;
+    rec = &ring->records[head & ring->mask];
+
+    rec->stamp_ns = ktime_to_ns(stamp);
+    rec->seq = head;
+    rec->repeat_count = min_t(unsigned int, repeat_count, U16_MAX);
+    rec->scancode = scancode;
+    rec->verdict = verdict;
+
+    smp_store_release(&ring->header->head, ring->head);
+    wake_up_interruptible(&ring->wait);
+}
+
+/*
+ * xbox_ring_set_filter
+ *
+ * Replace the packet filter, NULL detaches it.
+ */
+static void xbox_ring_set_filter(struct xbox_ring *ring, struct bpf_prog *prog)
+{
+    struct bpf_prog *old;
+
+    mutex_lock(&ring->filter_mutex);
+    old = rcu_replace_pointer(ring->filter, prog,
+                              lockdep_is_held(&ring->filter_mutex));
+    if (prog && !old)
+        static_branch_inc(&xbox_filter_key);
+    else if (!prog && old)
+        static_branch_dec(&xbox_filter_key);
+    mutex_unlock(&ring->filter_mutex);
+
+    if (old) {
+        synchronize_rcu();
+        bpf_prog_destroy(old);
+    }
+}
+
+static void xbox_ring_free(struct kref *kref)
+{
+    struct xbox_ring *ring = container_of(kref, struct xbox_ring, kref);
+
+    xbox_ring_set_filter(ring, NULL);
+    vfree(ring->header);
+    ida_free(&xbox_ring_ida, ring->id);
+    kfree(ring);
+}
+
+struct xbox_ring_file {
+    struct xbox_ring *ring;
+    u32 seen;                   /* head at the last poll */
+};
+
+static int xbox_ring_open(struct inode *inode, struct file *file)
+{
+    struct xbox_ring *ring =
+        container_of(file->private_data, struct xbox_ring, misc);
+    struct xbox_ring_file *rf;
+
+    rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+    if (!rf)
+        return -ENOMEM;
+
+    /* misc_open holds misc_mtx, so the ring cannot be deregistered here */
+    kref_get(&ring->kref);
+    rf->ring = ring;
+    rf->seen = READ_ONCE(ring->head);
+    file->private_data = rf;
+
+    return stream_open(inode, file);
+}
+
+static int xbox_ring_release(struct inode *inode, struct file *file)
+{
+    struct xbox_ring_file *rf = file->private_data;
+
+    kref_put(&rf->ring->kref, xbox_ring_free);
+    kfree(rf);
+
+    return 0;
+}
+
+static __poll_t xbox_ring_poll(struct file *file, poll_table *wait)
+{
+    struct xbox_ring_file *rf = file->private_data;
+    struct xbox_ring *ring = rf->ring;
+    u32 head;
+
+    poll_wait(file, &ring->wait, wait);
+
+    if (READ_ONCE(ring->dead))
+        return EPOLLHUP | EPOLLERR;
+
+    head = READ_ONCE(ring->head);
+    if (head == rf->seen)
+        return 0;
+
+    rf->seen = head;
+    return EPOLLIN | EPOLLRDNORM;
+}
+
+static int xbox_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct xbox_ring_file *rf = file->private_data;
+
+    if (!rf->ring->header)
+        return -ENODEV;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    /* nor may mprotect() make it writable later */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return remap_vmalloc_range(vma, rf->ring->header, vma->vm_pgoff);
+}
+
+/*
+ * xbox_filter_check
+ *
+ * Accept only instructions that make sense on a struct xbox_filter_data
+ * and turn its loads into loads from the context, as seccomp does.
+ */
+static int xbox_filter_check(struct sock_filter *filter, unsigned int flen)
+{
+    unsigned int pc;
+
+    for (pc = 0; pc < flen; pc++) {
+        struct sock_filter *ftest = &filter[pc];
+
+        switch (ftest->code) {
+        case BPF_LD | BPF_W | BPF_ABS:
+            ftest->code = BPF_LDX | BPF_W | BPF_ABS;
+            if (ftest->k >= sizeof(struct xbox_filter_data) || ftest->k & 3)
+                return -EINVAL;
+            continue;
+        case BPF_LD | BPF_W | BPF_LEN:
+            ftest->code = BPF_LD | BPF_IMM;
+            ftest->k = sizeof(struct xbox_filter_data);
+            continue;
+        case BPF_LDX | BPF_W | BPF_LEN:
+            ftest->code = BPF_LDX | BPF_IMM;
+            ftest->k = sizeof(struct xbox_filter_data);
+            continue;
+        case BPF_RET | BPF_K:
+        case BPF_RET | BPF_A:
+        case BPF_ALU | BPF_ADD | BPF_K:
+        case BPF_ALU | BPF_ADD | BPF_X:
+        case BPF_ALU | BPF_SUB | BPF_K:
+        case BPF_ALU | BPF_SUB | BPF_X:
+        case BPF_ALU | BPF_MUL | BPF_K:
+        case BPF_ALU | BPF_MUL | BPF_X:
+        case BPF_ALU | BPF_DIV | BPF_K:
+        case BPF_ALU | BPF_DIV | BPF_X:
+        case BPF_ALU | BPF_AND | BPF_K:
+        case BPF_ALU | BPF_AND | BPF_X:
+        case BPF_ALU | BPF_OR | BPF_K:
+        case BPF_ALU | BPF_OR | BPF_X:
+        case BPF_ALU | BPF_XOR | BPF_K:
+        case BPF_ALU | BPF_XOR | BPF_X:
+        case BPF_ALU | BPF_LSH | BPF_K:
+        case BPF_ALU | BPF_LSH | BPF_X:
+        case BPF_ALU | BPF_RSH | BPF_K:
+        case BPF_ALU | BPF_RSH | BPF_X:
+        case BPF_ALU | BPF_NEG:
+        case BPF_LD | BPF_IMM:
+        case BPF_LDX | BPF_IMM:
+        case BPF_MISC | BPF_TAX:
+        case BPF_MISC | BPF_TXA:
+        case BPF_LD | BPF_MEM:
+        case BPF_LDX | BPF_MEM:
+        case BPF_ST:
+        case BPF_STX:
+        case BPF_JMP | BPF_JA:
+        case BPF_JMP | BPF_JEQ | BPF_K:
+        case BPF_JMP | BPF_JEQ | BPF_X:
+        case BPF_JMP | BPF_JGE | BPF_K:
+        case BPF_JMP | BPF_JGE | BPF_X:
+        case BPF_JMP | BPF_JGT | BPF_K:
+        case BPF_JMP | BPF_JGT | BPF_X:
+        case BPF_JMP | BPF_JSET | BPF_K:
+        case BPF_JMP | BPF_JSET | BPF_X:
+            continue;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * xbox_ring_filter
+ *
+ * Attach the program fprog describes, or detach the filter if NULL.
+ */
+static long xbox_ring_filter(struct file *file, struct sock_fprog *fprog)
+{
+    struct xbox_ring_file *rf = file->private_data;
+    struct bpf_prog *prog = NULL;
+    int err;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    if (READ_ONCE(rf->ring->dead))
+        return -ENODEV;
+
+    if (fprog) {
+        err = bpf_prog_create_from_user(&prog, fprog, xbox_filter_check,
+                                        false);
+        if (err)
+            return err;
+    }
+
+    xbox_ring_set_filter(rf->ring, prog);
+    return 0;
+}
+
+static long xbox_ring_ioctl(struct file *file, unsigned int cmd,
+                unsigned long arg)
+{
+    struct sock_fprog fprog;
+
+    switch (cmd) {
+    case XBOX_IOC_SET_FILTER:
+        if (copy_from_user(&fprog, (void __user *)arg, sizeof(fprog)))
+            return -EFAULT;
+        return xbox_ring_filter(file, &fprog);
+    case XBOX_IOC_CLEAR_FILTER:
+        return xbox_ring_filter(file, NULL);
+    default:
+        return -ENOTTY;
+    }
+}
+
+#ifdef CONFIG_COMPAT
+/* XBOX_IOC_SET_FILTER from a 32-bit process, whose filter pointer is 32 bits */
+#define XBOX_IOC_SET_FILTER32   _IOW('X', 0x01, struct compat_sock_fprog)
+
+static long xbox_ring_compat_ioctl(struct file *file, unsigned int cmd,
+                unsigned long arg)
+{
+    struct compat_sock_fprog fprog32;
+    struct sock_fprog fprog;
+
+    switch (cmd) {
+    case XBOX_IOC_SET_FILTER32:
+        if (copy_from_user(&fprog32, compat_ptr(arg), sizeof(fprog32)))
+            return -EFAULT;
+        fprog.len = fprog32.len;
+        fprog.filter = compat_ptr(fprog32.filter);
+        return xbox_ring_filter(file, &fprog);
+    case XBOX_IOC_CLEAR_FILTER:
+        return xbox_ring_filter(file, NULL);
+    default:
+        return -ENOTTY;
+    }
+}
+#endif
+
+static const struct file_operations xbox_ring_fops = {
+    .owner          = THIS_MODULE,
+    .open           = xbox_ring_open,
+    .release        = xbox_ring_release,
+    .poll           = xbox_ring_poll,
+    .mmap           = xbox_ring_mmap,
+    .unlocked_ioctl = xbox_ring_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl   = xbox_ring_compat_ioctl,
+#endif
+};
+
+/*
+ * xbox_remote_filter_run
+ *
+ * Run the packet filter of the receiver on a packet, remapping data[2]
+ * if it asks to. Returns the action. Called with key_lock held.
+ */
+static u32 xbox_remote_filter_run(struct xbox_remote *xbox_remote,
+                unsigned char *data, ktime_t stamp)
+{
+    struct xbox_filter_data ctx;
+    struct bpf_prog *prog;
+    u32 ret = XBOX_FILTER_PASS;
+
+    if (!xbox_remote->scan_ring)
+        return XBOX_FILTER_PASS;
+
+    rcu_read_lock();
+    prog = rcu_dereference(xbox_remote->scan_ring->filter);
+    if (prog) {
+        ctx.scancode = data[2];
+        ctx.channel = data[3];
+        ctx.clock = data[4] << 8 | data[5];
+        ctx.held = xbox_remote->key_held ?
+            xbox_remote->old_data : XBOX_FILTER_NONE;
+        ctx.repeat_count = xbox_remote->repeat_count;
+        ctx.gap_usec = xbox_remote->old_time ?
+            min_t(s64, ktime_us_delta(stamp, xbox_remote->old_time),
+                  U32_MAX) : U32_MAX;
+        ret = bpf_prog_run(prog, &ctx);
+    }
+    rcu_read_unlock();
+
+    switch (ret & XBOX_FILTER_ACTION) {
+    case XBOX_FILTER_PASS:
+    case XBOX_FILTER_NEW:
+    case XBOX_FILTER_REPEAT:
+        if (ret & XBOX_FILTER_REMAP)
+            data[2] = ret & XBOX_FILTER_DATA;
+        return ret & XBOX_FILTER_ACTION;
+    default:
+        return XBOX_FILTER_DROP;
+    }
+}
+
+/*
+ * xbox_remote_ring_init
+ *
+ * Register the control node, with a ring only if ring_records is set.
+ */
+static int xbox_remote_ring_init(struct xbox_remote *xbox_remote)
+{
+    unsigned int records;
+    struct xbox_ring *ring;
+    int err = -ENOMEM;
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    kref_init(&ring->kref);
+    init_waitqueue_head(&ring->wait);
+
+    if (ring_records) {
+        records = roundup_pow_of_two(min(ring_records, RING_MAX_RECORDS));
+        ring->size = PAGE_ALIGN(PAGE_SIZE +
+                                records * sizeof(struct xbox_ring_record));
+        ring->header = vmalloc_user(ring->size);
+        if (!ring->header)
+            goto exit_free_ring;
+
+        ring->records = (void *)ring->header + PAGE_SIZE;
+        ring->header->version = XBOX_RING_VERSION;
+        ring->header->record_size = sizeof(struct xbox_ring_record);
+        ring->header->records = records;
+        ring->mask = records - 1;
+    }
+
+    mutex_init(&ring->filter_mutex);
+
+    ring->id = ida_alloc(&xbox_ring_ida, GFP_KERNEL);
+    if (ring->id < 0) {
+        err = ring->id;
+        goto exit_free_header;
+    }
+
+    snprintf(ring->name, sizeof(ring->name), "xbox_remote%d", ring->id);
+    ring->misc.minor = MISC_DYNAMIC_MINOR;
+    ring->misc.name = ring->name;
+    ring->misc.fops = &xbox_ring_fops;
+    ring->misc.parent = &xbox_remote->interface->dev;
+
+    err = misc_register(&ring->misc);
+    if (err)
+        goto exit_free_id;
+
+    xbox_remote->scan_ring = ring;
+    return 0;
+
+exit_free_id:
+    ida_free(&xbox_ring_ida, ring->id);
+exit_free_header:
+    vfree(ring->header);
+exit_free_ring:
+    kfree(ring);
+    return err;
+}
+
+/*
+ * xbox_remote_ring_exit
+ *
+ * Called once the urbs are dead, so nothing writes the ring anymore.
+ */
+static void xbox_remote_ring_exit(struct xbox_remote *xbox_remote)
+{
+    struct xbox_ring *ring = xbox_remote->scan_ring;
+
+    if (!ring)
+        return;
+
+    xbox_remote->scan_ring = NULL;
+    misc_deregister(&ring->misc);
+    WRITE_ONCE(ring->dead, true);
+    wake_up_interruptible(&ring->wait);
+    kref_put(&ring->kref, xbox_ring_free);
+}
+
+/*
+ * xbox_remote_report_timestamp
+ *
+ * Queue MSC_TIMESTAMP (usec, wraps) ahead of a key event, so it lands in
+ * the same frame as the rc-core key event and its input_sync.
+ */
+static void xbox_remote_report_timestamp(struct input_dev *idev, ktime_t stamp)
+{
+    input_event(idev, EV_MSC, MSC_TIMESTAMP, (u32)ktime_to_us(stamp));
+}
+
+static const char * const xbox_policy_names[] = {
+    [XBOX_POLICY_NORMAL]   = "normal",
+    [XBOX_POLICY_NOREPEAT] = "norepeat",
+    [XBOX_POLICY_FAST]     = "fast",
+    [XBOX_POLICY_BYPASS]   = "bypass",
+};
+
+static unsigned int xbox_remote_policy(struct xbox_remote *xbox_remote,
+                unsigned char scancode)
+{
+    return test_bit(scancode, xbox_remote->policy_lo) |
+           test_bit(scancode, xbox_remote->policy_hi) << 1;
+}
+
+static void xbox_remote_set_policy(struct xbox_remote *xbox_remote,
+                unsigned char scancode, unsigned int policy)
+{
+    assign_bit(scancode, xbox_remote->policy_lo, policy & 1);
+    assign_bit(scancode, xbox_remote->policy_hi, policy & 2);
+}
+
+/*
+ * xbox_remote_default_policy
+ */
+static unsigned int xbox_remote_default_policy(unsigned int keycode)
+{
+    switch (keycode) {
+    case KEY_HOME:
+    case KEY_MENU:
+        return XBOX_POLICY_NOREPEAT;
+    case KEY_UP:
+    case KEY_DOWN:
+    case KEY_LEFT:
+    case KEY_RIGHT:
+        return XBOX_POLICY_FAST;
+    case KEY_STOP:
+    case KEY_PAUSE:
+        return XBOX_POLICY_BYPASS;
+    default:
+        return XBOX_POLICY_NORMAL;
+    }
+}
+
+/*
+ * xbox_remote_policy_sync
+ *
+ * Derive the policies not set from sysfs from the current keymap.
+ */
+static void xbox_remote_policy_sync(struct xbox_remote *xbox_remote)
+{
+    unsigned int i, keycode;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_remote->keycodes); i++) {
+        if (test_bit(i, xbox_remote->policy_set))
+            continue;
+        keycode = READ_ONCE(xbox_remote->keycodes[i]);
+        xbox_remote_set_policy(xbox_remote, i,
+                               xbox_remote_default_policy(keycode));
+    }
+}
+
+/*
+ * xbox_remote_keymap_sync
+ *
+ * Rebuild the direct-indexed table and the policies from the rc-core
+ * keymap.
+ */
+static void xbox_remote_keymap_sync(struct xbox_remote *xbox_remote)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_remote->keycodes); i++)
+        WRITE_ONCE(xbox_remote->keycodes[i],
+                   rc_g_keycode_from_table(xbox_remote->rdev, i));
+    xbox_remote_policy_sync(xbox_remote);
+}
+
+/*
+ * xbox_remote_setkeycode
+ *
+ * Wraps the rc-core setkeycode handler (EVIOCSKEYCODE, ir-keytable) and
+ * keeps the table in step with it.
+ */
+static int xbox_remote_setkeycode(struct input_dev *idev,
+                const struct input_keymap_entry *ke,
+                unsigned int *old_keycode)
+{
+    struct rc_dev *rdev = input_get_drvdata(idev);
+    struct xbox_remote *xbox_remote = rdev->priv;
+    int retval;
+
+    retval = xbox_remote->rc_setkeycode(idev, ke, old_keycode);
+    if (!retval)
+        xbox_remote_keymap_sync(xbox_remote);
+
+    return retval;
+}
+
+/*
+ * xbox_remote_keymap_init
+ *
+ * rc-core only sets up the setkeycode handler when it registers the rc
+ * device, and udev may change the keymap right after that, so the table
+ * is built from the live keymap under the same lock the wrapper is
+ * installed with: every change lands either in the table or in the
+ * wrapper.
+ */
+static void xbox_remote_keymap_init(struct xbox_remote *xbox_remote)
+{
+    struct input_dev *idev = xbox_remote->rdev->input_dev;
+    unsigned long flags;
+
+    spin_lock_irqsave(&idev->event_lock, flags);
+    xbox_remote->rc_setkeycode = idev->setkeycode;
+    idev->setkeycode = xbox_remote_setkeycode;
+    xbox_remote_keymap_sync(xbox_remote);
+    spin_unlock_irqrestore(&idev->event_lock, flags);
+}
+
+/*
+ * xbox_gesture_key_valid
+ *
+ * Whether a gesture may send keycode, see xbox_remote_add_static_keys.
+ */
+static bool xbox_gesture_key_valid(unsigned int keycode)
+{
+    struct rc_map *map;
+    unsigned int i, j;
+
+    if (keycode >= KEY_MACRO1 && keycode <= KEY_MACRO30)
+        return true;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_generated_maps); i++) {
+        map = &xbox_generated_maps[i]->map;
+        for (j = 0; j < map->size; j++)
+            if (map->scan[j].keycode == keycode)
+                return true;
+    }
+
+    return false;
+}
+
+/*
+ * xbox_remote_add_static_keys
+ *
+ * Declare the keys of every built-in keymap and the gesture keycodes on
+ * an input device that is not registered yet.
+ */
+static void xbox_remote_add_static_keys(struct input_dev *idev)
+{
+    struct rc_map *map;
+    unsigned int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_generated_maps); i++) {
+        map = &xbox_generated_maps[i]->map;
+        for (j = 0; j < map->size; j++)
+            __set_bit(map->scan[j].keycode, idev->keybit);
+    }
+    for (i = KEY_MACRO1; i <= KEY_MACRO30; i++)
+        __set_bit(i, idev->keybit);
+    __clear_bit(KEY_RESERVED, idev->keybit);
+}
+
+/*
+ * xbox_remote_add_keys
+ *
+ * Advertise the keys of a receiver on an input device of its own or of
+ * its aggregate, before it is registered: those of its current keymap
+ * and the static ones, which cover the other receivers of an aggregate.
+ * Keys remapped to anything else later are only reported on the rc
+ * device.
+ */
+static void xbox_remote_add_keys(struct xbox_remote *xbox_remote,
+                struct input_dev *idev)
+{
+    unsigned int i, keycode;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_remote->keycodes); i++) {
+        keycode = READ_ONCE(xbox_remote->keycodes[i]);
+        if (keycode != KEY_RESERVED)
+            __set_bit(keycode, idev->keybit);
+    }
+
+    xbox_remote_add_static_keys(idev);
+}
+
+/*
+ * xbox_remote_input_setup
+ *
+ * Set up an input device reporting like the rc device of a receiver.
+ */
+static void xbox_remote_input_setup(struct xbox_remote *xbox_remote,
+                struct input_dev *idev, const char *name, const char *phys)
+{
+    idev->name = name;
+    idev->phys = phys;
+    usb_to_input_id(xbox_remote->udev, &idev->id);
+
+    __set_bit(EV_KEY, idev->evbit);
+    __set_bit(EV_REP, idev->evbit);
+    __set_bit(EV_MSC, idev->evbit);
+    __set_bit(MSC_SCAN, idev->mscbit);
+    __set_bit(MSC_TIMESTAMP, idev->mscbit);
+    __set_bit(MSC_RAW, idev->mscbit);
+    xbox_remote_add_keys(xbox_remote, idev);
+}
+
+/*
+ * xbox_aggregate_open_receiver
+ *
+ * Take a user of a receiver on behalf of its open aggregate. Called
+ * with the aggregate mutex held.
+ */
+static void xbox_aggregate_open_receiver(struct xbox_remote *xbox_remote)
+{
+    int err;
+
+    err = xbox_remote_open(xbox_remote);
+    if (err)
+        dev_warn(&xbox_remote->interface->dev,
+            "could not open for aggregate %u: %d\n",
+            xbox_remote->aggregate->id, err);
+    xbox_remote->aggregate_open = !err;
+}
+
+static void xbox_aggregate_close_receiver(struct xbox_remote *xbox_remote)
+{
+    if (xbox_remote->aggregate_open)
+        xbox_remote_close(xbox_remote);
+    xbox_remote->aggregate_open = false;
+}
+
+/*
+ * xbox_aggregate_input_open
+ *
+ * Nothing reaches the aggregate device unless its receivers are open,
+ * so opening it opens all of them, like opening their rc devices.
+ */
+static int xbox_aggregate_input_open(struct input_dev *idev)
+{
+    struct xbox_aggregate *agg = input_get_drvdata(idev);
+    struct xbox_remote *xbox_remote;
+
+    mutex_lock(&agg->mutex);
+    agg->opened = true;
+    list_for_each_entry(xbox_remote, &agg->receivers, aggregate_node)
+        xbox_aggregate_open_receiver(xbox_remote);
+    mutex_unlock(&agg->mutex);
+
+    return 0;
+}
+
+static void xbox_aggregate_input_close(struct input_dev *idev)
+{
+    struct xbox_aggregate *agg = input_get_drvdata(idev);
+    struct xbox_remote *xbox_remote;
+
+    mutex_lock(&agg->mutex);
+    agg->opened = false;
+    list_for_each_entry(xbox_remote, &agg->receivers, aggregate_node)
+        xbox_aggregate_close_receiver(xbox_remote);
+    mutex_unlock(&agg->mutex);
+}
+
+/*
+ * xbox_aggregate_create
+ *
+ * Called with xbox_aggregates_mutex held.
+ */
+static struct xbox_aggregate *xbox_aggregate_create(
+                struct xbox_remote *xbox_remote, unsigned int id)
+{
+    struct xbox_aggregate *agg;
+    struct input_dev *idev;
+
+    agg = kzalloc(sizeof(*agg), GFP_KERNEL);
+    idev = input_allocate_device();
+    if (!agg || !idev)
+        goto fail;
+
+    agg->id = id;
+    agg->idev = idev;
+    spin_lock_init(&agg->lock);
+    mutex_init(&agg->mutex);
+    INIT_LIST_HEAD(&agg->receivers);
+    snprintf(agg->name, sizeof(agg->name), DRIVER_DESC " aggregate %u", id);
+    snprintf(agg->phys, sizeof(agg->phys), "xbox_remote/aggregate%u", id);
+
+    xbox_remote_input_setup(xbox_remote, idev, agg->name, agg->phys);
+    idev->id.bustype = BUS_VIRTUAL;
+    idev->open = xbox_aggregate_input_open;
+    idev->close = xbox_aggregate_input_close;
+    input_set_drvdata(idev, agg);
+
+    if (input_register_device(idev))
+        goto fail;
+    idev->rep[REP_DELAY] = repeat_delay;
+
+    list_add(&agg->list, &xbox_aggregates);
+    return agg;
+
+fail:
+    input_free_device(idev);
+    kfree(agg);
+    return NULL;
+}
+
+/*
+ * xbox_aggregate_detach
+ *
+ * Called with xbox_aggregates_mutex held, which serialises joining and
+ * leaving.
+ */
+static void xbox_aggregate_detach(struct xbox_remote *xbox_remote)
+{
+    struct xbox_aggregate *agg = xbox_remote->aggregate;
+    unsigned int i;
+
+    if (!agg)
+        return;
+
+    spin_lock_irq(&xbox_remote->key_lock);
+    xbox_remote_key_release(xbox_remote, ktime_get());
+    /* A pending tap goes to the aggregate device before it goes away */
+    xbox_remote_gesture_flush(xbox_remote, ktime_get());
+    xbox_remote->aggregate = NULL;
+    spin_unlock_irq(&xbox_remote->key_lock);
+    hrtimer_cancel(&xbox_remote->gesture_timer);
+
+    spin_lock_irq(&agg->lock);
+    for (i = 0; i < AGGREGATE_PRESSES; i++)
+        if (agg->recent[i].first == xbox_remote)
+            agg->recent[i].first = NULL;
+    spin_unlock_irq(&agg->lock);
+
+    mutex_lock(&agg->mutex);
+    list_del(&xbox_remote->aggregate_node);
+    xbox_aggregate_close_receiver(xbox_remote);
+    mutex_unlock(&agg->mutex);
+
+    if (--agg->members == 0) {
+        list_del(&agg->list);
+        input_unregister_device(agg->idev);
+        kfree(agg);
+    }
+}
+
+/*
+ * xbox_aggregate_leave
+ */
+static void xbox_aggregate_leave(struct xbox_remote *xbox_remote)
+{
+    mutex_lock(&xbox_aggregates_mutex);
+    xbox_aggregate_detach(xbox_remote);
+    mutex_unlock(&xbox_aggregates_mutex);
+}
+
+/*
+ * xbox_aggregate_join
+ *
+ * Move the receiver to aggregate id, created on first use; 0 leaves.
+ */
+static int xbox_aggregate_join(struct xbox_remote *xbox_remote,
+                unsigned int id)
+{
+    struct xbox_aggregate *agg;
+    int err = 0;
+
+    mutex_lock(&xbox_aggregates_mutex);
+    if (xbox_remote->aggregate && xbox_remote->aggregate->id == id)
+        goto out;
+
+    xbox_aggregate_detach(xbox_remote);
+    if (!id)
+        goto out;
+
+    /* The device declared all keys at creation, see xbox_remote_add_keys */
+    list_for_each_entry(agg, &xbox_aggregates, list)
+        if (agg->id == id)
+            goto found;
+
+    agg = xbox_aggregate_create(xbox_remote, id);
+    if (!agg) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+found:
+    agg->members++;
+
+    spin_lock_irq(&xbox_remote->key_lock);
+    xbox_remote_key_release(xbox_remote, ktime_get());
+    xbox_remote->aggregate = agg;
+    /* The last receiver to calibrate sets the delay of the aggregate */
+    if (calibrate && xbox_remote->calibrated)
+        agg->idev->rep[REP_DELAY] = xbox_remote->rep_delay;
+    spin_unlock_irq(&xbox_remote->key_lock);
+
+    mutex_lock(&agg->mutex);
+    list_add_tail(&xbox_remote->aggregate_node, &agg->receivers);
+    if (agg->opened)
+        xbox_aggregate_open_receiver(xbox_remote);
+    mutex_unlock(&agg->mutex);
+
+out:
+    mutex_unlock(&xbox_aggregates_mutex);
+    return err;
+}
+
+/*
+ * xbox_aggregate_param_id
+ *
+ * The aggregate the aggregate parameter assigns to a receiver, 0 for none.
+ */
+static unsigned int xbox_aggregate_param_id(struct xbox_remote *xbox_remote)
+{
+    const char *p = aggregate;
+    size_t len, path_len;
+    unsigned int id;
+    const char *eq;
+
+    if (!p)
+        return 0;
+
+    path_len = strlen(xbox_remote->rc_phys) - strlen("/input0");
+
+    while (*p) {
+        len = strcspn(p, ",");
+        eq = memchr(p, '=', len);
+
+        if ((eq ? eq - p : len) == path_len &&
+            !strncmp(p, xbox_remote->rc_phys, path_len)) {
+            if (!eq)
+                return 1;
+            if (sscanf(eq + 1, "%u", &id) == 1)
+                return id;
+            return 0;
+        }
+
+        p += len;
+        if (*p)
+            p++;
+    }
+
+    return 0;
+}
+
+/*
+ * xbox_aggregate_claim
+ *
+ * Returns true if the receiver is the first of its aggregate to report
+ * this press. Called with key_lock held.
+ */
+static bool xbox_aggregate_claim(struct xbox_remote *xbox_remote,
+                unsigned char scancode, u16 clock, ktime_t stamp)
+{
+    struct xbox_aggregate *agg = xbox_remote->aggregate;
+    s64 window = (s64)READ_ONCE(aggregate_window) * NSEC_PER_MSEC;
+    struct xbox_aggregate_press *press;
+    unsigned int i;
+    s64 lag;
+
+    spin_lock(&agg->lock);
+
+    /* Newest first, so a press is matched against its latest copy */
+    for (i = 1; i <= AGGREGATE_PRESSES; i++) {
+        press = &agg->recent[(agg->recent_next - i) % AGGREGATE_PRESSES];
+        if (!press->stamp || press->scancode != scancode ||
+            press->clock != clock)
+            continue;
+
+        lag = ktime_to_ns(ktime_sub(stamp, press->stamp));
+        if (abs(lag) >= window)
+            continue;
+
+        if (press->first == xbox_remote)
+            break;      /* a new press of this receiver */
+
+        spin_unlock(&agg->lock);
+        xbox_stat_inc(xbox_remote, aggregate_copies);
+        xbox_hist_add(&xbox_remote->copy_hist, ns_to_ktime(max(lag, 0LL)));
+        return false;
+    }
+
+    press = &agg->recent[agg->recent_next++ % AGGREGATE_PRESSES];
+    press->stamp = stamp;
+    press->first = xbox_remote;
+    press->clock = clock;
+    press->scancode = scancode;
+
+    spin_unlock(&agg->lock);
+    xbox_stat_inc(xbox_remote, aggregate_first);
+    return true;
+}
+
+/*
+ * Channel and pointer devices get events only while the receiver is
+ * open, so they open the receiver like the rc device does.
+ */
+static int xbox_remote_input_open(struct input_dev *idev)
+{
+    return xbox_remote_open(input_get_drvdata(idev));
+}
+
+static void xbox_remote_input_close(struct input_dev *idev)
+{
+    xbox_remote_close(input_get_drvdata(idev));
+}
+
+/*
+ * xbox_remote_channels_init
+ *
+ * Register an input device for each channel in channel_devices. Presses
+ * on other channels stay on the rc device.
+ */
+static int xbox_remote_channels_init(struct xbox_remote *xbox_remote)
+{
+    struct xbox_channel *chan;
+    struct input_dev *idev;
+    unsigned int i;
+    int err;
+
+    xbox_remote->channels = kcalloc(XBOX_CHANNELS, sizeof(*chan), GFP_KERNEL);
+    if (!xbox_remote->channels)
+        return -ENOMEM;
+
+    for (i = 0; i < XBOX_CHANNELS; i++) {
+        if (!(channel_devices & BIT(i)))
+            continue;
+
+        chan = &xbox_remote->channels[i];
+        idev = input_allocate_device();
+        if (!idev)
+            return -ENOMEM;
+
+        snprintf(chan->name, sizeof(chan->name), "%s channel %u",
+                 xbox_remote->rc_name, i);
+        snprintf(chan->phys, sizeof(chan->phys), "%.*s/input%u",
+                 (int)(strlen(xbox_remote->rc_phys) - strlen("/input0")),
+                 xbox_remote->rc_phys, i + 1);
+        xbox_remote_input_setup(xbox_remote, idev, chan->name, chan->phys);
+        idev->dev.parent = &xbox_remote->interface->dev;
+        idev->open = xbox_remote_input_open;
+        idev->close = xbox_remote_input_close;
+        input_set_drvdata(idev, xbox_remote);
+
+        err = input_register_device(idev);
+        if (err) {
+            input_free_device(idev);
+            return err;
+        }
+
+        /* Calibration may finish meanwhile, the receiver can be open */
+        spin_lock_irq(&xbox_remote->key_lock);
+        idev->rep[REP_DELAY] = xbox_remote->rdev->input_dev->rep[REP_DELAY];
+        chan->idev = idev;
+        spin_unlock_irq(&xbox_remote->key_lock);
+    }
+
+    return 0;
+}
+
+/*
+ * xbox_remote_channels_exit
+ */
+static void xbox_remote_channels_exit(struct xbox_remote *xbox_remote)
+{
+    unsigned int i;
+
+    if (!xbox_remote->channels)
+        return;
+
+    spin_lock_irq(&xbox_remote->key_lock);
+    xbox_remote_key_release(xbox_remote, ktime_get());
+    spin_unlock_irq(&xbox_remote->key_lock);
+
+    for (i = 0; i < XBOX_CHANNELS; i++)
+        if (xbox_remote->channels[i].idev)
+            input_unregister_device(xbox_remote->channels[i].idev);
+
+    kfree(xbox_remote->channels);
+    xbox_remote->channels = NULL;
+}
+
+/*
+ * xbox_remote_pointer_init
+ */
+static int xbox_remote_pointer_init(struct xbox_remote *xbox_remote)
+{
+    struct input_dev *idev;
+    int err;
+
+    idev = input_allocate_device();
+    if (!idev)
+        return -ENOMEM;
+
+    snprintf(xbox_remote->pointer_name, sizeof(xbox_remote->pointer_name),
+             "%s pointer", xbox_remote->rc_name);
+    snprintf(xbox_remote->pointer_phys, sizeof(xbox_remote->pointer_phys),
+             "%.*s/pointer0",
+             (int)(strlen(xbox_remote->rc_phys) - strlen("/input0")),
+             xbox_remote->rc_phys);
+
+    idev->name = xbox_remote->pointer_name;
+    idev->phys = xbox_remote->pointer_phys;
+    usb_to_input_id(xbox_remote->udev, &idev->id);
+    idev->dev.parent = &xbox_remote->interface->dev;
+    idev->open = xbox_remote_input_open;
+    idev->close = xbox_remote_input_close;
+    input_set_drvdata(idev, xbox_remote);
+
+    __set_bit(EV_REL, idev->evbit);
+    __set_bit(REL_X, idev->relbit);
+    __set_bit(REL_Y, idev->relbit);
+    /* Never pressed, but marks the device as a mouse */
+    __set_bit(EV_KEY, idev->evbit);
+    __set_bit(BTN_LEFT, idev->keybit);
+
+    err = input_register_device(idev);
+    if (err) {
+        input_free_device(idev);
+        return err;
+    }
+
+    xbox_remote->pointer = idev;
+    return 0;
+}
+
+static void xbox_remote_pointer_exit(struct xbox_remote *xbox_remote)
+{
+    if (!xbox_remote->pointer)
+        return;
+
+    input_unregister_device(xbox_remote->pointer);
+    xbox_remote->pointer = NULL;
+}
+
+/*
+ * xbox_remote_arrow
+ *
+ * Pointer direction of an arrow key, false for other keys.
+ */
+static bool xbox_remote_arrow(unsigned int keycode, int *dx, int *dy)
+{
+    *dx = 0;
+    *dy = 0;
+
+    switch (keycode) {
+    case KEY_UP:
+        *dy = -1;
+        return true;
+    case KEY_DOWN:
+        *dy = 1;
+        return true;
+    case KEY_LEFT:
+        *dx = -1;
+        return true;
+    case KEY_RIGHT:
+        *dx = 1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * xbox_remote_accel_factor
+ *
+ * Factor of the acceleration profile after a key was held for held.
+ */
+static unsigned int xbox_remote_accel_factor(ktime_t held)
+{
+    unsigned int nfactor = min_t(unsigned int, READ_ONCE(accel_nfactor),
+                                 ACCEL_STEPS);
+    unsigned int nmsecs = READ_ONCE(accel_nmsecs);
+    s64 msecs = ktime_to_ms(held);
+    unsigned int i;
+
+    if (!nfactor)
+        return 1;
+
+    for (i = 0; i < nfactor - 1 && i < nmsecs; i++)
+        if (msecs < accel_msecs[i])
+            break;
+
+    return max(READ_ONCE(accel_factor[i]), 1U);
+}
+
+/*
+ * xbox_remote_accel_step
+ *
+ * One step of an accelerated key, a pointer move or a keydown/keyup
+ * pair. Returns the time to the next step. Called with key_lock held.
+ */
+static ktime_t xbox_remote_accel_step(struct xbox_remote *xbox_remote,
+                ktime_t now)
+{
+    unsigned int factor =
+        xbox_remote_accel_factor(ktime_sub(now, xbox_remote->first_time));
+    struct input_dev *idev;
+    int dx, dy;
+
+    if (xbox_remote->pointer &&
+        xbox_remote_arrow(xbox_remote->held_keycode, &dx, &dy)) {
+        if (dx)
+            input_report_rel(xbox_remote->pointer, REL_X, dx * factor);
+        if (dy)
+            input_report_rel(xbox_remote->pointer, REL_Y, dy * factor);
+        input_sync(xbox_remote->pointer);
+        return ms_to_ktime(ACCEL_POINTER_PERIOD);
+    }
+
+    idev = xbox_remote->held_idev ?: xbox_remote->rdev->input_dev;
+    input_report_key(idev, xbox_remote->held_keycode, 1);
+    input_sync(idev);
+    input_report_key(idev, xbox_remote->held_keycode, 0);
+    input_sync(idev);
+    xbox_stat_inc(xbox_remote, events);
+
+    return ns_to_ktime(max_t(u64, (u64)READ_ONCE(accel_period) *
+                             NSEC_PER_MSEC / factor, NSEC_PER_MSEC));
+}
+
+/*
+ * xbox_remote_gesture_send
+ *
+ * Send keycode as a tap on the device of the gesture. Called with
+ * key_lock held.
+ */
+static void xbox_remote_gesture_send(struct xbox_remote *xbox_remote,
+                unsigned int keycode, ktime_t stamp)
+{
+    struct input_dev *idev = xbox_remote->gesture_idev;
+
+    trace_xbox_remote_keydown(xbox_remote->gesture_scancode, 0);
+    xbox_remote_report_timestamp(idev, stamp);
+    input_event(idev, EV_MSC, MSC_SCAN, xbox_remote->gesture_scancode);
+    input_report_key(idev, keycode, 1);
+    input_sync(idev);
+    trace_xbox_remote_keyup(xbox_remote->gesture_scancode, 0);
+    input_report_key(idev, keycode, 0);
+    input_sync(idev);
+    atomic_long_add(2, &xbox_remote->stats.events);
+}
+
+/*
+ * xbox_remote_gesture_flush
+ *
+ * Send a single tap still waiting for a second press as its own
+ * keycode. Called with key_lock held.
+ */
+static void xbox_remote_gesture_flush(struct xbox_remote *xbox_remote,
+                ktime_t stamp)
+{
+    if (xbox_remote->gesture_state != GESTURE_RELEASED)
+        return;
+
+    hrtimer_try_to_cancel(&xbox_remote->gesture_timer);
+    xbox_remote->gesture_state = GESTURE_IDLE;
+    xbox_remote_gesture_send(xbox_remote, xbox_remote->gesture_keycode, stamp);
+}
+
+/*
+ * xbox_remote_gesture_press
+ *
+ * Feed a new press to the gesture engine. Returns true when the engine
+ * took it and no keydown must be sent. Called with key_lock held.
+ */
+static bool xbox_remote_gesture_press(struct xbox_remote *xbox_remote,
+                struct input_dev *idev, unsigned char scancode,
+                unsigned int keycode, ktime_t stamp)
+{
+    u16 long_key = READ_ONCE(xbox_remote->gesture_long_keys[scancode]);
+    u16 double_key = READ_ONCE(xbox_remote->gesture_double_keys[scancode]);
+
+    if (xbox_remote->gesture_state == GESTURE_RELEASED) {
+        if (scancode == xbox_remote->gesture_scancode && double_key &&
+            idev == xbox_remote->gesture_idev) {
+            hrtimer_try_to_cancel(&xbox_remote->gesture_timer);
+            xbox_remote->gesture_state = GESTURE_DONE;
+            xbox_remote->key_suppressed = true;
+            xbox_remote_gesture_send(xbox_remote, double_key, stamp);
+            xbox_stat_inc(xbox_remote, gesture_doubles);
+            return true;
+        }
+        xbox_remote_gesture_flush(xbox_remote, stamp);
+    }
+
+    if (likely(!long_key && !double_key))
+        return false;
+
+    xbox_remote->gesture_state = GESTURE_PRESSED;
+    xbox_remote->gesture_scancode = scancode;
+    xbox_remote->gesture_keycode = keycode;
+    xbox_remote->gesture_idev = idev;
+    xbox_remote->key_suppressed = true;
+    if (long_key) {
+        xbox_remote->gesture_deadline =
+            ktime_add_ms(stamp, READ_ONCE(gesture_long));
+        hrtimer_start(&xbox_remote->gesture_timer,
+                      xbox_remote->gesture_deadline, HRTIMER_MODE_ABS);
+    }
+
+    return true;
+}
+
+/*
+ * xbox_remote_gesture_release
+ *
+ * The key of the gesture in progress was released. Called with
+ * key_lock held.
+ */
+static void xbox_remote_gesture_release(struct xbox_remote *xbox_remote,
+                ktime_t stamp)
+{
+    switch (xbox_remote->gesture_state) {
+    case GESTURE_PRESSED:
+        hrtimer_try_to_cancel(&xbox_remote->gesture_timer);
+        if (!READ_ONCE(xbox_remote->gesture_double_keys[
+                           xbox_remote->gesture_scancode])) {
+            xbox_remote->gesture_state = GESTURE_IDLE;
+            xbox_remote_gesture_send(xbox_remote,
+                                     xbox_remote->gesture_keycode, stamp);
+            break;
+        }
+        xbox_remote->gesture_state = GESTURE_RELEASED;
+        xbox_remote->gesture_deadline =
+            ktime_add_ms(stamp, READ_ONCE(gesture_double));
+        hrtimer_start(&xbox_remote->gesture_timer,
+                      xbox_remote->gesture_deadline, HRTIMER_MODE_ABS);
+        break;
+    case GESTURE_DONE:
+        xbox_remote->gesture_state = GESTURE_IDLE;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * xbox_remote_gesture_timer
+ *
+ * A held key became a long press, or a tap got no second press.
+ */
+static enum hrtimer_restart xbox_remote_gesture_timer(struct hrtimer *timer)
+{
+    struct xbox_remote *xbox_remote =
+        container_of(timer, struct xbox_remote, gesture_timer);
+    unsigned long flags;
+    ktime_t now = ktime_get();
+
+    spin_lock_irqsave(&xbox_remote->key_lock, flags);
+
+    /* Lost the race with a cancel, the timer has been started again */
+    if (ktime_before(now, xbox_remote->gesture_deadline))
+        goto out;
+
+    switch (xbox_remote->gesture_state) {
+    case GESTURE_PRESSED:
+        xbox_remote->gesture_state = GESTURE_DONE;
+        xbox_remote_gesture_send(xbox_remote,
+            READ_ONCE(xbox_remote->gesture_long_keys[
+                          xbox_remote->gesture_scancode]), now);
+        xbox_stat_inc(xbox_remote, gesture_longs);
+        break;
+    case GESTURE_RELEASED:
+        xbox_remote->gesture_state = GESTURE_IDLE;
+        xbox_remote_gesture_send(xbox_remote,
+                                 xbox_remote->gesture_keycode, now);
+        break;
+    default:
+        break;
+    }
+
+out:
+    spin_unlock_irqrestore(&xbox_remote->key_lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * xbox_remote_key_up
+ *
+ * Send the keyup of the held key. Called with key_lock held.
+ */
+static void xbox_remote_key_up(struct xbox_remote *xbox_remote, ktime_t stamp)
+{
+    struct input_dev *idev = xbox_remote->held_idev;
+
+    trace_xbox_remote_keyup(xbox_remote->old_data, xbox_remote->repeat_count);
+    if (idev) {
+        xbox_remote_report_timestamp(idev, stamp);
+        input_report_key(idev, xbox_remote->held_keycode, 0);
+        input_sync(idev);
+    } else {
+        xbox_remote_report_timestamp(xbox_remote->rdev->input_dev, stamp);
+        rc_keyup(xbox_remote->rdev);
+    }
+    xbox_stat_inc(xbox_remote, events);
+}
+
+/*
+ * xbox_remote_key_release
+ *
+ * Called with key_lock held.
+ */
+static void xbox_remote_key_release(struct xbox_remote *xbox_remote,
+                ktime_t stamp)
+{
+    if (!xbox_remote->key_held)
+        return;
+
+    xbox_remote->key_held = false;
+    hrtimer_try_to_cancel(&xbox_remote->repeat_timer);
+    xbox_hist_add(&xbox_remote->hold_hist,
+                  ktime_sub(xbox_remote->old_time, xbox_remote->first_time));
+    if (xbox_remote->gesture_state != GESTURE_IDLE)
+        xbox_remote_gesture_release(xbox_remote, stamp);
+    if (!xbox_remote->key_suppressed)
+        xbox_remote_key_up(xbox_remote, stamp);
+}
+
+/*
+ * xbox_remote_early_repeat
+ *
+ * Repeat the held key ahead of input autorepeat. Returns false once
+ * autorepeat has taken over. Called with key_lock held.
+ */
+static bool xbox_remote_early_repeat(struct xbox_remote *xbox_remote,
+                ktime_t now)
+{
+    struct input_dev *idev = xbox_remote->held_idev ?:
+        xbox_remote->rdev->input_dev;
+
+    if (xbox_remote->key_suppressed ||
+        xbox_remote->held_keycode == KEY_RESERVED ||
+        !ktime_before(now, ktime_add_ms(xbox_remote->first_time,
+                                        idev->rep[REP_DELAY])))
+        return false;
+
+    input_event(idev, EV_KEY, xbox_remote->held_keycode, 2);
+    input_sync(idev);
+    xbox_stat_inc(xbox_remote, events);
+
+    return true;
+}
+
+/*
+ * xbox_remote_repeat_timer
+ *
+ * Repeats of a key with the fast policy, steps of an accelerated one.
+ */
+static enum hrtimer_restart xbox_remote_repeat_timer(struct hrtimer *timer)
+{
+    struct xbox_remote *xbox_remote =
+        container_of(timer, struct xbox_remote, repeat_timer);
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+    struct input_dev *idev;
+    unsigned long flags;
+
+    spin_lock_irqsave(&xbox_remote->key_lock, flags);
+    if (!xbox_remote->key_held)
+        goto out;
+
+    if (xbox_remote->held_policy == XBOX_POLICY_ACCEL) {
+        hrtimer_forward_now(timer,
+            xbox_remote_accel_step(xbox_remote, ktime_get()));
+        restart = HRTIMER_RESTART;
+        goto out;
+    }
+
+    if (xbox_remote->held_policy != XBOX_POLICY_FAST ||
+        !xbox_remote_early_repeat(xbox_remote, ktime_get()))
+        goto out;
+
+    idev = xbox_remote->held_idev ?: xbox_remote->rdev->input_dev;
+    if (idev->rep[REP_PERIOD]) {
+        hrtimer_forward_now(timer, ms_to_ktime(idev->rep[REP_PERIOD]));
+        restart = HRTIMER_RESTART;
+    }
+
+out:
+    spin_unlock_irqrestore(&xbox_remote->key_lock, flags);
+    return restart;
+}
+
+/*
+ * xbox_remote_release_timer
+ *
+ * Fires the filter time after the last packet of a held key. The
+ * report path may rearm the timer while this callback waits for the
+ * lock, so check the deadline again before releasing.
+ */
+static enum hrtimer_restart xbox_remote_release_timer(struct hrtimer *timer)
+{
+    struct xbox_remote *xbox_remote =
+        container_of(timer, struct xbox_remote, release_timer);
+    unsigned long flags;
+
+    spin_lock_irqsave(&xbox_remote->key_lock, flags);
+    if (!xbox_remote->key_held ||
+        ktime_after(ktime_add(xbox_remote->old_time,
+                              xbox_remote_filter_time(xbox_remote)),
+                    ktime_get()))
+        goto out;
+
+    dbginfo(&xbox_remote->interface->dev, "release %02x after %u repeats\n",
+            xbox_remote->old_data, xbox_remote->repeat_count);
+    xbox_remote_calib_press(xbox_remote);
+    xbox_remote_key_release(xbox_remote, ktime_get());
+
+out:
+    spin_unlock_irqrestore(&xbox_remote->key_lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * xbox_remote_is_repeat
+ *
+ * Decide whether a packet continues the held key. While the clock is
+ * not known to be usable, fall back to the time window heuristic and
+ * use its verdicts to learn the clock behaviour.
+ */
+static bool xbox_remote_is_repeat(struct xbox_remote *xbox_remote,
+                unsigned char scancode, u8 channel, u16 clock, ktime_t now)
+{
+    bool same_key, heuristic;
+
+    same_key = xbox_remote->key_held && xbox_remote->old_data == scancode &&
+        xbox_remote->old_channel == channel;
+
+    if (use_clock && xbox_remote->clock_mode == CLOCK_USABLE)
+        return same_key && clock == xbox_remote->old_clock;
+
+    heuristic = same_key &&
+        ktime_before(now, ktime_add(xbox_remote->old_time,
+                                    xbox_remote_filter_time(xbox_remote)));
+
+    /* old_clock is valid once a packet was seen, held key or not */
+    if (xbox_remote->clock_mode == CLOCK_LEARNING && xbox_remote->old_time) {
+        bool same_clock = clock == xbox_remote->old_clock;
+
+        /* A repeat keeps the clock, a new press must change it */
+        if (heuristic != same_clock)
+            xbox_remote->clock_misses++;
+        else if (!heuristic)
+            xbox_remote->clock_presses++;
+
+        if (++xbox_remote->clock_samples == CLOCK_SAMPLES) {
+            xbox_remote->clock_mode =
+                xbox_remote->clock_misses * CLOCK_MISS_RATIO <= CLOCK_SAMPLES &&
+                xbox_remote->clock_presses >= CLOCK_PRESSES ?
+                CLOCK_USABLE : CLOCK_UNUSABLE;
+            dev_info(&xbox_remote->interface->dev,
+                "packet clock %s (%u of %u samples disagree, %u presses changed it)\n",
+                xbox_remote->clock_mode == CLOCK_USABLE ? "usable" : "unusable",
+                xbox_remote->clock_misses, CLOCK_SAMPLES,
+                xbox_remote->clock_presses);
+        }
+    }
+
+    return heuristic;
+}
+
+/*
+ * xbox_remote_keydown
+ *
+ * Send a new press, to the aggregate if the receiver belongs to one,
+ * else to the device of its channel if it has one, unless the gesture
+ * engine holds it back. keycode is the entry of the table for the
+ * scancode, never KEY_RESERVED. Called with key_lock held.
+ */
+static void xbox_remote_keydown(struct xbox_remote *xbox_remote,
+                const unsigned char *data, unsigned int keycode, ktime_t stamp)
+{
+    struct input_dev *idev = xbox_remote->rdev->input_dev;
+    unsigned char scancode = data[2];
+
+    xbox_remote->held_policy = xbox_remote_policy(xbox_remote, scancode);
+    if (xbox_remote->held_policy == XBOX_POLICY_FAST && READ_ONCE(accel))
+        xbox_remote->held_policy = XBOX_POLICY_ACCEL;
+
+    if (xbox_remote->aggregate)
+        idev = xbox_remote->aggregate->idev;
+    else if (xbox_remote->channels && xbox_remote->channels[data[3]].idev)
+        idev = xbox_remote->channels[data[3]].idev;
+
+    if (idev != xbox_remote->rdev->input_dev) {
+        /* The device cannot take keys it did not declare */
+        if (!test_bit(keycode, idev->keybit)) {
+            xbox_stat_inc(xbox_remote, unmapped);
+            xbox_remote->key_suppressed = true;
+            return;
+        }
+    }
+
+    if (xbox_remote_gesture_press(xbox_remote, idev, scancode, keycode,
+                                  stamp)) {
+        atomic_inc(&xbox_remote->stats.presses[scancode]);
+        return;
+    }
+
+    if (xbox_remote->held_policy == XBOX_POLICY_ACCEL && xbox_remote->pointer) {
+        int dx, dy;
+
+        if (xbox_remote_arrow(keycode, &dx, &dy)) {
+            /* The pointer moves instead, no key events at all */
+            xbox_remote->held_idev = idev;
+            xbox_remote->held_keycode = keycode;
+            xbox_remote->key_suppressed = true;
+            trace_xbox_remote_keydown(scancode, 0);
+            atomic_inc(&xbox_remote->stats.presses[scancode]);
+            hrtimer_start(&xbox_remote->repeat_timer,
+                          xbox_remote_accel_step(xbox_remote, stamp),
+                          HRTIMER_MODE_REL);
+            return;
+        }
+    }
+
+    trace_xbox_remote_keydown(scancode, 0);
+    xbox_remote_report_timestamp(idev, stamp);
+    input_event(idev, EV_MSC, MSC_RAW,
+                (u32)data[2] << 24 | data[3] << 16 | data[4] << 8 | data[5]);
+    if (idev != xbox_remote->rdev->input_dev) {
+        xbox_remote->held_idev = idev;
+        xbox_remote->held_keycode = keycode;
+        input_event(idev, EV_MSC, MSC_SCAN, scancode);
+        input_report_key(idev, keycode, 1);
+        input_sync(idev);
+    } else {
+        /* rc-core keeps its keyup, LED and last_keycode state */
+        xbox_remote->held_idev = NULL;
+        /* Policy repeats bypass rc-core and need the keycode */
+        xbox_remote->held_keycode =
+            xbox_remote->held_policy == XBOX_POLICY_NORMAL ? KEY_RESERVED :
+            keycode;
+        rc_keydown_notimeout(xbox_remote->rdev, RC_PROTO_OTHER,
+                             scancode, data[2]);
+    }
+    xbox_stat_inc(xbox_remote, events);
+    atomic_inc(&xbox_remote->stats.presses[scancode]);
+    xbox_hist_add(&xbox_remote->report_hist, ktime_sub(ktime_get(), stamp));
+
+    switch (xbox_remote->held_policy) {
+    case XBOX_POLICY_NOREPEAT:
+        xbox_remote_key_up(xbox_remote, stamp);
+        xbox_remote->key_suppressed = true;
+        break;
+    case XBOX_POLICY_FAST:
+        hrtimer_start(&xbox_remote->repeat_timer,
+                      ms_to_ktime(READ_ONCE(repeat_fast_delay)),
+                      HRTIMER_MODE_REL);
+        break;
+    case XBOX_POLICY_ACCEL:
+        /* Steps take over from the first press, no autorepeat */
+        xbox_remote_key_up(xbox_remote, stamp);
+        xbox_remote->key_suppressed = true;
+        hrtimer_start(&xbox_remote->repeat_timer,
+                      ms_to_ktime(READ_ONCE(repeat_fast_delay)),
+                      HRTIMER_MODE_REL);
+        break;
+    }
+}
+
+/*
+ * xbox_remote_report_input
+ *
+ * The first packet of a press sends the keydown; the following packets
+ * only push the release timer further. stamp is the completion time of
+ * the urb that carried the packet. Called with key_lock held.
+ */
+static void xbox_remote_input_report(struct xbox_remote *xbox_remote,
+                unsigned char *data, unsigned int len, ktime_t stamp)
+{
+    unsigned char scancode;
+    unsigned int keycode;
+    u32 action = XBOX_FILTER_PASS;
+    u16 clock;
+    ktime_t now;
+
+    /* Deal with strange looking inputs */
+    if (len != 6 
+        || data[0] != 0x00
+        ||  data[1] != 0x06
+        ||  data[3] >= XBOX_CHANNELS
+        ||  (data[3] != XBOX_STOCK_CHANNEL &&
+             !READ_ONCE(channel_mask) && !channel_devices)
+       )
+    {
+        trace_xbox_remote_header(data, len, false);
+        trace_xbox_remote_filter(len > 2 ? data[2] : 0, 0,
+                                 XBOX_VERDICT_MALFORMED);
+        xbox_remote_dump(xbox_remote, data, len, stamp);
+        if (xbox_remote->scan_ring)
+            xbox_ring_add(xbox_remote->scan_ring, len > 2 ? data[2] : 0,
+                          XBOX_VERDICT_MALFORMED, 0, stamp);
+        return;
+    }
+        
+    trace_xbox_remote_header(data, len, true);
+    xbox_stat_inc(xbox_remote, packets);
+
+    if (static_branch_unlikely(&xbox_filter_key))
+        action = xbox_remote_filter_run(xbox_remote, data, stamp);
+    if (unlikely(action == XBOX_FILTER_DROP ||
+                 (action == XBOX_FILTER_REPEAT && !xbox_remote->key_held))) {
+        xbox_stat_inc(xbox_remote, filtered);
+        trace_xbox_remote_filter(data[2], xbox_remote->repeat_count,
+                                 XBOX_VERDICT_FILTERED);
+        if (xbox_remote->scan_ring)
+            xbox_ring_add(xbox_remote->scan_ring, data[2],
+                          XBOX_VERDICT_FILTERED, 0, stamp);
+        return;
+    }
+
+    scancode = data[2];
+    clock = data[4] << 8 | data[5];
+
+    keycode = READ_ONCE(xbox_remote->keycodes[scancode]);
+    if (keycode == KEY_RESERVED) {
+        xbox_stat_inc(xbox_remote, unmapped);
+        trace_xbox_remote_filter(scancode, 0, XBOX_VERDICT_UNMAPPED);
+        if (xbox_remote->scan_ring)
+            xbox_ring_add(xbox_remote->scan_ring, scancode,
+                          XBOX_VERDICT_UNMAPPED, 0, stamp);
+        return;
+    }
+
+    now = stamp;
+
+    if (xbox_remote->old_data == scancode && xbox_remote->old_time)
+        xbox_hist_add(&xbox_remote->gap_hist,
+                      ktime_sub(now, xbox_remote->old_time));
+    
+    dbginfo(
+            &xbox_remote->interface->dev,
+            "time: %lld key data %02x, scancode %02x, clock %04x\n",
+            ktime_to_us(now),
+            data[2], 
+            scancode,
+            clock
+           );
+
+    /* The filter may have decided already */
+    if (action == XBOX_FILTER_PASS ?
+        xbox_remote_is_repeat(xbox_remote, scancode, data[3], clock, now) :
+        action == XBOX_FILTER_REPEAT)
+    {
+        ktime_t gap = ktime_sub(now, xbox_remote->old_time);
+
+        if (calibrate && !xbox_remote->calibrated) {
+            xbox_remote->gap_max = max(xbox_remote->gap_max, gap);
+            xbox_remote->gap_sum += ktime_to_ns(gap);
+            xbox_remote->gap_count++;
+        }
+        xbox_remote->repeat_count++;
+        if (ktime_before(now, ktime_add_ms(xbox_remote->first_time,
+                         xbox_remote->rdev->input_dev->rep[REP_DELAY])))
+            xbox_stat_inc(xbox_remote, duplicates);
+        else
+            xbox_stat_inc(xbox_remote, held);
+        trace_xbox_remote_filter(scancode, xbox_remote->repeat_count,
+                                 XBOX_VERDICT_REPEAT);
+        if (xbox_remote->scan_ring)
+            xbox_ring_add(xbox_remote->scan_ring, scancode, XBOX_VERDICT_REPEAT,
+                          xbox_remote->repeat_count, stamp);
+        /* Until the hold is confirmed these are duplicates of a tap */
+        if (xbox_remote->held_policy == XBOX_POLICY_BYPASS &&
+            !ktime_before(now, ktime_add_ms(xbox_remote->first_time,
+                                            READ_ONCE(repeat_fast_delay))))
+            xbox_remote_early_repeat(xbox_remote, now);
+    } 
+    else {
+        /* A new press releases the key still held */
+        xbox_remote_key_release(xbox_remote, stamp);
+
+        xbox_remote->repeat_count = 0;
+        xbox_remote->first_time = now;
+        xbox_remote->old_data = scancode;
+        xbox_remote->old_channel = data[3];
+        xbox_remote->key_held = true;
+
+        trace_xbox_remote_filter(scancode, 0, XBOX_VERDICT_NEW);
+        if (xbox_remote->scan_ring)
+            xbox_ring_add(xbox_remote->scan_ring, scancode, XBOX_VERDICT_NEW,
+                          0, stamp);
+
+        /* Another receiver of the aggregate may have sent it already */
+        xbox_remote->key_suppressed = xbox_remote->aggregate &&
+            !xbox_aggregate_claim(xbox_remote, scancode, clock, stamp);
+        if (!xbox_remote->key_suppressed)
+            xbox_remote_keydown(xbox_remote, data, keycode, stamp);
+    }
+
+    xbox_remote->old_time = now;
+    xbox_remote->old_clock = clock;
+    hrtimer_start(&xbox_remote->release_timer,
+                  xbox_remote_filter_time(xbox_remote), HRTIMER_MODE_REL);
+}
+
+
+/*
+ * xbox_remote_count_urb_error
+ */
+static void xbox_remote_count_urb_error(struct xbox_remote *xbox_remote,
+                int status)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_urb_errors) - 1; i++)
+        if (xbox_urb_errors[i].status == status)
+            break;
+
+    atomic_long_inc(&xbox_remote->stats.urb_errors[i]);
+}
+
+/*
+ * The attribute groups are the driver's dev_groups, so they sit on the
+ * usb interface and exist only while it is bound, from the end of probe
+ * to the start of disconnect.
+ */
+static struct xbox_remote *xbox_remote_from_dev(struct device *dev)
+{
+    return usb_get_intfdata(to_usb_interface(dev));
+}
+
+/*
+ * Statistics, in the stats group of the usb interface
+ */
+#define XBOX_STAT_ATTR(field)                                           \
+static ssize_t field##_show(struct device *dev,                         \
+                struct device_attribute *attr, char *buf)               \
+{                                                                       \
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);        \
+                                                                        \
+    return sprintf(buf, "%ld\n",                                        \
+                   atomic_long_read(&xbox_remote->stats.field));        \
+}                                                                       \
+static DEVICE_ATTR_RO(field)
+
+XBOX_STAT_ATTR(packets);
+XBOX_STAT_ATTR(malformed_byte);
+XBOX_STAT_ATTR(malformed_key);
+XBOX_STAT_ATTR(malformed_data);
+XBOX_STAT_ATTR(duplicates);
+XBOX_STAT_ATTR(held);
+XBOX_STAT_ATTR(events);
+XBOX_STAT_ATTR(resubmit_errors);
+XBOX_STAT_ATTR(fifo_overflows);
+XBOX_STAT_ATTR(unmapped);
+XBOX_STAT_ATTR(recoveries);
+XBOX_STAT_ATTR(halts_cleared);
+XBOX_STAT_ATTR(resets);
+XBOX_STAT_ATTR(runtime_suspends);
+XBOX_STAT_ATTR(runtime_vetoes);
+XBOX_STAT_ATTR(suspended_usec);
+XBOX_STAT_ATTR(wakeups);
+XBOX_STAT_ATTR(wakeup_usec);
+XBOX_STAT_ATTR(poll_fast_usec);
+XBOX_STAT_ATTR(poll_slow_usec);
+XBOX_STAT_ATTR(poll_switches);
+XBOX_STAT_ATTR(aggregate_first);
+XBOX_STAT_ATTR(aggregate_copies);
+XBOX_STAT_ATTR(masked);
+XBOX_STAT_ATTR(filtered);
+XBOX_STAT_ATTR(gesture_longs);
+XBOX_STAT_ATTR(gesture_doubles);
+
+static ssize_t urb_errors_show(struct device *dev,
+                struct device_attribute *attr, char *buf)
+{
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);
+    unsigned int i;
+    ssize_t len = 0;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_urb_errors); i++)
+        len += sysfs_emit_at(buf, len, "%s %ld\n", xbox_urb_errors[i].name,
+                    atomic_long_read(&xbox_remote->stats.urb_errors[i]));
+
+    return len;
+}
+static DEVICE_ATTR_RO(urb_errors);
+
+static ssize_t presses_show(struct device *dev,
+                struct device_attribute *attr, char *buf)
+{
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);
+    unsigned int i, count;
+    ssize_t len = 0;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_remote->stats.presses); i++) {
+        count = atomic_read(&xbox_remote->stats.presses[i]);
+        if (count)
+            len += sysfs_emit_at(buf, len, "0x%02x %u\n", i, count);
+    }
+
+    return len;
+}
+static DEVICE_ATTR_RO(presses);
+
+static struct attribute *xbox_stats_attrs[] = {
+    &dev_attr_packets.attr,
+    &dev_attr_malformed_byte.attr,
+    &dev_attr_malformed_key.attr,
+    &dev_attr_malformed_data.attr,
+    &dev_attr_duplicates.attr,
+    &dev_attr_held.attr,
+    &dev_attr_events.attr,
+    &dev_attr_resubmit_errors.attr,
+    &dev_attr_fifo_overflows.attr,
+    &dev_attr_unmapped.attr,
+    &dev_attr_recoveries.attr,
+    &dev_attr_halts_cleared.attr,
+    &dev_attr_resets.attr,
+    &dev_attr_runtime_suspends.attr,
+    &dev_attr_runtime_vetoes.attr,
+    &dev_attr_suspended_usec.attr,
+    &dev_attr_wakeups.attr,
+    &dev_attr_wakeup_usec.attr,
+    &dev_attr_poll_fast_usec.attr,
+    &dev_attr_poll_slow_usec.attr,
+    &dev_attr_poll_switches.attr,
+    &dev_attr_aggregate_first.attr,
+    &dev_attr_aggregate_copies.attr,
+    &dev_attr_masked.attr,
+    &dev_attr_filtered.attr,
+    &dev_attr_gesture_longs.attr,
+    &dev_attr_gesture_doubles.attr,
+    &dev_attr_urb_errors.attr,
+    &dev_attr_presses.attr,
+    NULL
+};
+
+static const struct attribute_group xbox_stats_group = {
+    .name  = "stats",
+    .attrs = xbox_stats_attrs,
+};
+
+/*
+ * xbox_remote_poll_check
+ *
+ * Validate a new value of one of the polling limits. slow_ms may not
+ * drop below fast_ms, except 0, and neither interval can change on a
+ * controller that ignores it. Called with open_mutex held.
+ */
+static int xbox_remote_poll_check(struct xbox_remote *xbox_remote,
+                unsigned int *field, unsigned int val)
+{
+    unsigned int fast = xbox_remote->poll_fast_ms;
+    unsigned int slow = xbox_remote->poll_slow_ms;
+
+    if (field == &xbox_remote->poll_idle_ms)
+        return 0;
+    if (xbox_remote->poll_fixed)
+        return -EOPNOTSUPP;
+
+    if (field == &xbox_remote->poll_fast_ms)
+        fast = val;
+    else
+        slow = val;
+
+    return slow && slow < fast ? -EINVAL : 0;
+}
+
+/*
+ * Adaptive polling limits, in the poll group of the usb interface. Writes
+ * take effect at the next mode check, which they trigger.
+ */
+#define XBOX_POLL_ATTR(field, min, max)                                 \
+static ssize_t field##_show(struct device *dev,                         \
+                struct device_attribute *attr, char *buf)               \
+{                                                                       \
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);        \
+                                                                        \
+    return sprintf(buf, "%u\n", READ_ONCE(xbox_remote->poll_##field));  \
+}                                                                       \
+static ssize_t field##_store(struct device *dev,                        \
+                struct device_attribute *attr, const char *buf,         \
+                size_t count)                                           \
+{                                                                       \
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);        \
+    unsigned int val;                                                   \
+    int err;                                                            \
+                                                                        \
+    err = kstrtouint(buf, 0, &val);                                     \
+    if (err)                                                            \
+        return err;                                                     \
+    if (val < (min) || val > (max))                                     \
+        return -EINVAL;                                                 \
+                                                                        \
+    mutex_lock(&xbox_remote->open_mutex);                               \
+    err = xbox_remote_poll_check(xbox_remote,                           \
+                                 &xbox_remote->poll_##field, val);      \
+    if (!err)                                                           \
+        WRITE_ONCE(xbox_remote->poll_##field, val);                     \
+    mutex_unlock(&xbox_remote->open_mutex);                             \
+    if (err)                                                            \
+        return err;                                                     \
+    mod_delayed_work(system_wq, &xbox_remote->poll_work, 0);            \
+                                                                        \
+    return count;                                                       \
+}                                                                       \
+static DEVICE_ATTR_RW(field)
+
+/*
+ * usb_submit_urb caps full and low speed interrupt intervals at 128
+ * frames and rounds them down to a power of two, so the ring polls at
+ * xbox_remote_poll_interval() rather than at the exact value.
+ */
+XBOX_POLL_ATTR(fast_ms, 1, 128);
+XBOX_POLL_ATTR(slow_ms, 0, 128);
+XBOX_POLL_ATTR(idle_ms, 1, 60000);
+
+static struct attribute *xbox_poll_attrs[] = {
+    &dev_attr_fast_ms.attr,
+    &dev_attr_slow_ms.attr,
+    &dev_attr_idle_ms.attr,
+    NULL
+};
+
+static const struct attribute_group xbox_poll_group = {
+    .name  = "poll",
+    .attrs = xbox_poll_attrs,
+};
+
+/*
+ * Aggregate membership, in the aggregate group of the usb interface. 0 makes
+ * the receiver report on its own.
+ */
+static ssize_t id_show(struct device *dev,
+                struct device_attribute *attr, char *buf)
+{
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);
+    struct xbox_aggregate *agg;
+    unsigned int id;
+
+    mutex_lock(&xbox_aggregates_mutex);
+    agg = xbox_remote->aggregate;
+    id = agg ? agg->id : 0;
+    mutex_unlock(&xbox_aggregates_mutex);
+
+    return sprintf(buf, "%u\n", id);
+}
+
+static ssize_t id_store(struct device *dev,
+                struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);
+    unsigned int id;
+    int err;
+
+    err = kstrtouint(buf, 0, &id);
+    if (err)
+        return err;
+
+    /* Not under open_mutex, an open aggregate opens the receiver */
+    err = xbox_aggregate_join(xbox_remote, id);
+
+    return err ?: count;
+}
+static DEVICE_ATTR_RW(id);
+
+static struct attribute *xbox_aggregate_attrs[] = {
+    &dev_attr_id.attr,
+    NULL
+};
+
+static const struct attribute_group xbox_aggregate_group = {
+    .name  = "aggregate",
+    .attrs = xbox_aggregate_attrs,
+};
+
+/*
+ * Repeat policies, in the policy group of the usb interface. Reading lists
+ * the scancodes with a policy other than normal, those set from sysfs
+ * marked with *. Writing "<scancode> <policy>" sets one, policy
+ * "default" returns it to the keymap default.
+ */
+static ssize_t keys_show(struct device *dev,
+                struct device_attribute *attr, char *buf)
+{
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);
+    unsigned int i, policy;
+    ssize_t len = 0;
+
+    for (i = 0; i < 256; i++) {
+        policy = xbox_remote_policy(xbox_remote, i);
+        if (policy != XBOX_POLICY_NORMAL ||
+            test_bit(i, xbox_remote->policy_set))
+            len += sysfs_emit_at(buf, len, "0x%02x %s%s\n", i,
+                        xbox_policy_names[policy],
+                        test_bit(i, xbox_remote->policy_set) ? " *" : "");
+    }
+
+    return len;
+}
+
+static ssize_t keys_store(struct device *dev,
+                struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);
+    int scancode, policy;
+    char name[16];
+
+    if (sscanf(buf, "%i %15s", &scancode, name) != 2 ||
+        scancode < 0 || scancode > 0xff)
+        return -EINVAL;
+
+    if (!strcmp(name, "default")) {
+        clear_bit(scancode, xbox_remote->policy_set);
+        xbox_remote_policy_sync(xbox_remote);
+        return count;
+    }
+
+    policy = match_string(xbox_policy_names, ARRAY_SIZE(xbox_policy_names),
+                          name);
+    if (policy < 0)
+        return policy;
+
+    set_bit(scancode, xbox_remote->policy_set);
+    xbox_remote_set_policy(xbox_remote, scancode, policy);
+
+    return count;
+}
+static DEVICE_ATTR_RW(keys);
+
+static struct attribute *xbox_policy_attrs[] = {
+    &dev_attr_keys.attr,
+    NULL
+};
+
+static const struct attribute_group xbox_policy_group = {
+    .name  = "policy",
+    .attrs = xbox_policy_attrs,
+};
+
+/*
+ * Gesture keycodes, in the gesture group of the usb interface. Reading lists
+ * the scancodes with a gesture as "<scancode> <long> <double>", writing
+ * the same sets them, keycode 0 for none.
+ */
+static ssize_t gesture_keys_show(struct device *dev,
+                struct device_attribute *attr, char *buf)
+{
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);
+    unsigned int i, long_key, double_key;
+    ssize_t len = 0;
+
+    for (i = 0; i < 256; i++) {
+        long_key = READ_ONCE(xbox_remote->gesture_long_keys[i]);
+        double_key = READ_ONCE(xbox_remote->gesture_double_keys[i]);
+        if (long_key || double_key)
+            len += sysfs_emit_at(buf, len, "0x%02x %u %u\n", i,
+                                 long_key, double_key);
+    }
+
+    return len;
+}
+
+static ssize_t gesture_keys_store(struct device *dev,
+                struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct xbox_remote *xbox_remote = xbox_remote_from_dev(dev);
+    int scancode;
+    unsigned int long_key, double_key;
+
+    if (sscanf(buf, "%i %u %u", &scancode, &long_key, &double_key) != 3 ||
+        scancode < 0 || scancode > 0xff ||
+        (long_key && !xbox_gesture_key_valid(long_key)) ||
+        (double_key && !xbox_gesture_key_valid(double_key)))
+        return -EINVAL;
+
+    WRITE_ONCE(xbox_remote->gesture_long_keys[scancode], long_key);
+    WRITE_ONCE(xbox_remote->gesture_double_keys[scancode], double_key);
+
+    return count;
+}
+
+static struct device_attribute dev_attr_gesture_keys =
+    __ATTR(keys, 0644, gesture_keys_show, gesture_keys_store);
 
-    wait_queue_head_t wait;
-    int send_flags;
+static struct attribute *xbox_gesture_attrs[] = {
+    &dev_attr_gesture_keys.attr,
+    NULL
+};
 
-    int users; /* 0-2, users are rc and input */
-    struct mutex open_mutex;
+static const struct attribute_group xbox_gesture_group = {
+    .name  = "gesture",
+    .attrs = xbox_gesture_attrs,
 };
 
+static const struct attribute_group *xbox_groups[] = {
+    &xbox_stats_group,
+    &xbox_poll_group,
+    &xbox_aggregate_group,
+    &xbox_policy_group,
+    &xbox_gesture_group,
+    NULL
+};
 
 /*
- * xbox_remote_dump_input
+ * xbox_remote_park
+ *
+ * Leave the ring to recover_work, which restarts it after the current
+ * backoff. Called with ring_lock held.
  */
-static void xbox_remote_dump(struct device *dev, unsigned char *data,
-                unsigned int len)
+static void xbox_remote_park(struct xbox_remote *xbox_remote, int status)
 {
-    if (len == 1) {
-        if (data[0] != (unsigned char)0xff && data[0] != 0x00)
-            dev_warn(dev, "Weird byte 0x%02x\n", data[0]);
-    } else if (len == 4)
-        dev_warn(dev, "Weird key %*ph\n", 4, data);
-    else {
-        //dev_warn(dev, "Weird data, len=%d %*ph ...\n", len, 6, data);
-    }
+    if (!xbox_remote->fault_start)
+        xbox_remote->fault_start = ktime_get();
+
+    if (xbox_remote->recovering)
+        return;
+
+    xbox_remote->recovering = true;
+    if (status == -EPIPE)
+        xbox_remote->halted = true;
+
+    dev_dbg(&xbox_remote->interface->dev,
+        "%s: urb error %d, restarting in %u msec\n",
+        __func__, status, xbox_remote->backoff);
+    schedule_delayed_work(&xbox_remote->recover_work,
+                          msecs_to_jiffies(xbox_remote->backoff));
+    xbox_remote->backoff = min(xbox_remote->backoff * 2,
+                               max(max_backoff, (unsigned int)BACKOFF_MIN));
 }
 
 /*
- * xbox_remote_open
+ * xbox_remote_urb_error
+ *
+ * Classify a failed urb. Returns true if the slot should be resubmitted
+ * right away, otherwise the ring is left to recover_work. Called with
+ * ring_lock held.
  */
-static int xbox_remote_open(struct xbox_remote *xbox_remote)
+static bool xbox_remote_urb_error(struct xbox_remote *xbox_remote, int status)
 {
-    int err = 0;
+    xbox_remote_count_urb_error(xbox_remote, status);
 
-    mutex_lock(&xbox_remote->open_mutex);
+    if (!xbox_remote->fault_start)
+        xbox_remote->fault_start = ktime_get();
 
-    if (xbox_remote->users++ != 0)
-        goto out; /* one was already active */
+    if (xbox_remote->recovering)
+        return false;
 
-    /* On first open, submit the read urb which was set up previously. */
-    xbox_remote->irq_urb->dev = xbox_remote->udev;
-    if (usb_submit_urb(xbox_remote->irq_urb, GFP_KERNEL)) {
-        dev_err(&xbox_remote->interface->dev,
-            "%s: usb_submit_urb failed!\n", __func__);
-        err = -EIO;
-    }
+    if (status != -EPIPE && ++xbox_remote->err_streak < ERR_RETRY)
+        return true;
 
-out:    mutex_unlock(&xbox_remote->open_mutex);
-    return err;
+    /* Stall, or an error storm: park the ring and back off */
+    xbox_remote_park(xbox_remote, status);
+    return false;
 }
 
 /*
- * xbox_remote_close
+ * xbox_remote_urb_ok
+ *
+ * A good packet ends a fault. Called with ring_lock held.
  */
-static void xbox_remote_close(struct xbox_remote *xbox_remote)
+static void xbox_remote_urb_ok(struct xbox_remote *xbox_remote, ktime_t stamp)
 {
-    mutex_lock(&xbox_remote->open_mutex);
-    if (--xbox_remote->users == 0)
-        usb_kill_urb(xbox_remote->irq_urb);
-    mutex_unlock(&xbox_remote->open_mutex);
-}
+    if (!xbox_remote->fault_start)
+        return;
 
+    xbox_hist_add(&xbox_remote->recovery_hist,
+                  ktime_sub(stamp, xbox_remote->fault_start));
+    dev_dbg(&xbox_remote->interface->dev, "recovered after %lld usec\n",
+        ktime_to_us(ktime_sub(stamp, xbox_remote->fault_start)));
 
-static int xbox_remote_rc_open(struct rc_dev *rdev)
-{
-    struct xbox_remote *xbox_remote = rdev->priv;
-    return xbox_remote_open(xbox_remote);
+    xbox_remote->fault_start = 0;
+    xbox_remote->err_streak = 0;
+    xbox_remote->backoff = BACKOFF_MIN;
 }
 
-
-static void xbox_remote_rc_close(struct rc_dev *rdev)
+/*
+ * xbox_remote_queue_packet
+ *
+ * Threaded mode: hand a packet to the decode thread. The completion path
+ * is the only producer (serialised by ring_lock), the thread the only
+ * consumer, so the kfifo needs no further locking.
+ */
+static void xbox_remote_queue_packet(struct xbox_remote *xbox_remote,
+                unsigned char *data, unsigned int len, ktime_t stamp)
 {
-    struct xbox_remote *xbox_remote = rdev->priv;
-    xbox_remote_close(xbox_remote);
-}
+    struct xbox_packet packet;
+
+    packet.stamp = stamp;
+    packet.len = min_t(unsigned int, len, U8_MAX);
+    memcpy(packet.data, data, min_t(unsigned int, len, PACKET_BYTES));
 
+    if (!kfifo_put(&xbox_remote->fifo, packet))
+        xbox_stat_inc(xbox_remote, fifo_overflows);
+
+    wake_up(&xbox_remote->wait);
+}
 
 /*
- * xbox_remote_report_input
+ * xbox_remote_thread
  */
-static void xbox_remote_input_report(struct urb *urb)
+static int xbox_remote_thread(void *arg)
 {
-    struct xbox_remote *xbox_remote = urb->context;
-    unsigned char *data= xbox_remote->inbuf;
-    int index = -1;
-    int remote_num;
-    unsigned char scancode;
+    struct xbox_remote *xbox_remote = arg;
+    struct xbox_packet packet;
 
-    /* Deal with strange looking inputs */
-    if (urb->actual_length != 6 
-        || data[0] != 0x00
-        ||  data[1] != 0x06
-        ||  data[3] != 0x0a
-       )
-    {
-        xbox_remote_dump(&urb->dev->dev, data, urb->actual_length);
-        return;
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(xbox_remote->wait,
+            !kfifo_is_empty(&xbox_remote->fifo) || kthread_should_stop());
+
+        while (kfifo_get(&xbox_remote->fifo, &packet)) {
+            spin_lock_irq(&xbox_remote->key_lock);
+            xbox_remote_input_report(xbox_remote, packet.data,
+                                     packet.len, packet.stamp);
+            spin_unlock_irq(&xbox_remote->key_lock);
+        }
     }
-        
-    xbox_remote_dump(&urb->dev->dev, data, urb->actual_length);
-    scancode = data[2];
 
-    unsigned long now = jiffies;
-    
-    dbginfo(
-            &xbox_remote->interface->dev,
-            "time: %lu key data %02x, scancode %02x\n",
-            jiffies_to_msecs(now),
-            data[2], 
-            scancode
-           );
+    return 0;
+}
 
-    if (index < 0) {
-       
-        //if data is the old one 
-        //and
-        //now is before old_time + repeat filter
-        if (xbox_remote->old_data == data[2] &&
-            time_before(now, xbox_remote->old_jiffies +
-                     msecs_to_jiffies(repeat_filter))) 
-        {
-            xbox_remote->repeat_count++;
-        } 
-        else {
-            xbox_remote->repeat_count = 0;
-            xbox_remote->old_jiffies = now;
-            xbox_remote->first_jiffies = now;
-            xbox_remote->old_data = data[2];
-        }
+/*
+ * xbox_remote_start_thread
+ */
+static int xbox_remote_start_thread(struct xbox_remote *xbox_remote)
+{
+    struct task_struct *thread;
+    int err;
 
-        /* Ensure we skip at least the 4 first duplicate events
-         * (generated by a single keypress), and continue skipping
-         * until repeat_delay msecs have passed.
-         */
-        if (xbox_remote->repeat_count > 0 &&
-            (xbox_remote->repeat_count < 5 ||
-             time_before(now, xbox_remote->first_jiffies +
-                      msecs_to_jiffies(repeat_delay))))
-            return;
+    err = kfifo_alloc(&xbox_remote->fifo, FIFO_PACKETS, GFP_KERNEL);
+    if (err)
+        return err;
 
-        rc_keydown_notimeout(xbox_remote->rdev,
-                             RC_PROTO_OTHER,
-                             scancode, data[2]);
-        rc_keyup(xbox_remote->rdev);
+    thread = kthread_create(xbox_remote_thread, xbox_remote, "xbox_remote/%s",
+                            dev_name(&xbox_remote->interface->dev));
+    if (IS_ERR(thread)) {
+        kfifo_free(&xbox_remote->fifo);
+        return PTR_ERR(thread);
     }
-    
-    dbginfo(
-            &xbox_remote->interface->dev,
-            "end"
-           );
-    //input_sync(dev);
+
+    if (thread_cpu >= 0) {
+        if (thread_cpu < nr_cpu_ids && cpu_online(thread_cpu))
+            kthread_bind(thread, thread_cpu);
+        else
+            dev_warn(&xbox_remote->interface->dev,
+                "thread_cpu %d is not online, not binding\n", thread_cpu);
+    }
+
+    /* Modules only get the two SCHED_FIFO levels the kernel hands out */
+    if (thread_prio == 1)
+        sched_set_fifo_low(thread);
+    else if (thread_prio > 1)
+        sched_set_fifo(thread);
+
+    xbox_remote->thread = thread;
+    wake_up_process(thread);
+
+    return 0;
+}
+
+/*
+ * xbox_remote_stop_thread
+ */
+static void xbox_remote_stop_thread(struct xbox_remote *xbox_remote)
+{
+    if (!xbox_remote->thread)
+        return;
+
+    kthread_stop(xbox_remote->thread);
+    xbox_remote->thread = NULL;
+    kfifo_free(&xbox_remote->fifo);
 }
 
+/*
+ * xbox_remote_masked
+ *
+ * Packets of the channels in channel_mask are dropped as soon as they
+ * complete, before the filter sees them.
+ */
+static bool xbox_remote_masked(const unsigned char *data, unsigned int len)
+{
+    unsigned long mask = READ_ONCE(channel_mask);
+
+    return mask && len == 6 && data[3] < XBOX_CHANNELS &&
+        (mask & BIT(data[3]));
+}
 
 /*
  * xbox_remote_irq_in
+ *
+ * All slots of the ring are queued on the same endpoint, so the host
+ * controller completes them in submission order. A slot that completes
+ * ahead of ring_head is parked until the slots before it have been
+ * reported; each slot is resubmitted right after its packet has been
+ * handled, which keeps the endpoint busy and the ring order stable.
  */
 static void xbox_remote_irq_in(struct urb *urb)
 {
-    struct xbox_remote *xbox_remote = urb->context;
+    struct xbox_remote_urb *ru = urb->context;
+    struct xbox_remote *xbox_remote = ru->xbox_remote;
+    unsigned long flags;
+    unsigned int i;
+    bool resubmit;
     int retval;
 
+    trace_xbox_remote_urb_complete(ru->seq, urb->status, ru->buf,
+                                   urb->actual_length);
+
     switch (urb->status) {
-    case 0:         /* success */
-        xbox_remote_input_report(urb);
-        break;
     case -ECONNRESET:   /* unlink */
     case -ENOENT:
     case -ESHUTDOWN:
@@ -326,17 +3868,141 @@ static void xbox_remote_irq_in(struct urb *urb)
             "%s: urb error status, unlink?\n",
             __func__);
         return;
-    default:        /* error */
-        dev_dbg(&xbox_remote->interface->dev,
-            "%s: Nonzero urb status %d\n",
-            __func__, urb->status);
     }
 
-    retval = usb_submit_urb(urb, GFP_ATOMIC);
-    if (retval)
-        dev_err(&xbox_remote->interface->dev,
-            "%s: usb_submit_urb()=%d\n",
-            __func__, retval);
+    spin_lock_irqsave(&xbox_remote->ring_lock, flags);
+    ru->stamp = ktime_get();
+    ru->done = true;
+
+    for (i = 0; i < xbox_remote->num_urbs; i++) {
+        ru = &xbox_remote->ring[xbox_remote->ring_head];
+
+        if (ru->active) {
+            if (!ru->done)
+                break;
+
+            if (ru->seq != xbox_remote->report_seq)
+                dev_dbg(&xbox_remote->interface->dev,
+                    "%s: urb seq %u, expected %u\n",
+                    __func__, ru->seq, xbox_remote->report_seq);
+            xbox_remote->report_seq = ru->seq + 1;
+
+            resubmit = !xbox_remote->recovering;
+
+            switch (ru->urb->status) {
+            case 0:         /* success */
+                xbox_remote_urb_ok(xbox_remote, ru->stamp);
+                if (xbox_remote_masked(ru->buf, ru->urb->actual_length)) {
+                    xbox_stat_inc(xbox_remote, masked);
+                    break;
+                }
+                usb_mark_last_busy(xbox_remote->udev);
+                xbox_remote->last_packet = ru->stamp;
+                if (!READ_ONCE(xbox_remote->poll_fast))
+                    schedule_delayed_work(&xbox_remote->poll_work, 0);
+                if (xbox_remote->thread) {
+                    xbox_remote_queue_packet(xbox_remote, ru->buf,
+                                             ru->urb->actual_length, ru->stamp);
+                    break;
+                }
+                spin_lock(&xbox_remote->key_lock);
+                xbox_remote_input_report(xbox_remote, ru->buf,
+                                         ru->urb->actual_length, ru->stamp);
+                spin_unlock(&xbox_remote->key_lock);
+                break;
+            default:        /* error */
+                dev_dbg(&xbox_remote->interface->dev,
+                    "%s: Nonzero urb status %d\n",
+                    __func__, ru->urb->status);
+                resubmit = xbox_remote_urb_error(xbox_remote,
+                                                 ru->urb->status);
+            }
+
+            if (!resubmit) {
+                ru->active = false;
+                goto next;
+            }
+
+            retval = xbox_remote_submit_urb(ru, GFP_ATOMIC);
+            if (retval) {
+                trace_xbox_remote_resubmit_error(ru->seq, retval);
+                xbox_stat_inc(xbox_remote, resubmit_errors);
+                dev_err(&xbox_remote->interface->dev,
+                    "%s: usb_submit_urb()=%d\n",
+                    __func__, retval);
+                /*
+                 * The slot is out of the ring now; unless the device is
+                 * going away, restart the whole ring after a backoff.
+                 */
+                if (retval != -ENODEV && retval != -EPERM &&
+                    retval != -ESHUTDOWN)
+                    xbox_remote_park(xbox_remote, retval);
+            }
+        }
+
+next:
+        xbox_remote->ring_head =
+            (xbox_remote->ring_head + 1) % xbox_remote->num_urbs;
+    }
+
+    spin_unlock_irqrestore(&xbox_remote->ring_lock, flags);
+}
+
+/*
+ * xbox_buf_pool_get
+ *
+ * Find or create the packet buffer pool of the controller udev is on.
+ * Controllers without DMA or with local memory are left to
+ * usb_alloc_coherent(), which knows about them, as is a failed pool.
+ */
+static struct xbox_buf_pool *xbox_buf_pool_get(struct usb_device *udev)
+{
+    struct usb_hcd *hcd = bus_to_hcd(udev->bus);
+    struct device *dev = udev->bus->sysdev;
+    struct xbox_buf_pool *bp;
+
+    if (!hcd_uses_dma(hcd) || hcd->localmem_pool)
+        return NULL;
+
+    mutex_lock(&xbox_buf_pools_mutex);
+    list_for_each_entry(bp, &xbox_buf_pools, list) {
+        if (bp->dev == dev) {
+            bp->users++;
+            goto out;
+        }
+    }
+
+    bp = kzalloc(sizeof(*bp), GFP_KERNEL);
+    if (!bp)
+        goto out;
+
+    bp->pool = dma_pool_create("xbox_remote", dev, DATA_BUFSIZE, 64, 0);
+    if (!bp->pool) {
+        kfree(bp);
+        bp = NULL;
+        goto out;
+    }
+    bp->dev = dev;
+    bp->users = 1;
+    list_add(&bp->list, &xbox_buf_pools);
+
+out:
+    mutex_unlock(&xbox_buf_pools_mutex);
+    return bp;
+}
+
+static void xbox_buf_pool_put(struct xbox_buf_pool *bp)
+{
+    if (!bp)
+        return;
+
+    mutex_lock(&xbox_buf_pools_mutex);
+    if (--bp->users == 0) {
+        list_del(&bp->list);
+        dma_pool_destroy(bp->pool);
+        kfree(bp);
+    }
+    mutex_unlock(&xbox_buf_pools_mutex);
 }
 
 /*
@@ -345,14 +4011,29 @@ static void xbox_remote_irq_in(struct urb *urb)
 static int xbox_remote_alloc_buffers(struct usb_device *udev,
                     struct xbox_remote *xbox_remote)
 {
-    xbox_remote->inbuf = usb_alloc_coherent(udev, DATA_BUFSIZE, GFP_ATOMIC,
-                           &xbox_remote->inbuf_dma);
-    if (!xbox_remote->inbuf)
-        return -1;
+    unsigned int i;
+
+    xbox_remote->num_urbs = clamp(num_urbs, 1, MAX_URBS);
+    xbox_remote->buf_pool = xbox_buf_pool_get(udev);
+
+    for (i = 0; i < xbox_remote->num_urbs; i++) {
+        struct xbox_remote_urb *ru = &xbox_remote->ring[i];
 
-    xbox_remote->irq_urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!xbox_remote->irq_urb)
-        return -1;
+        ru->xbox_remote = xbox_remote;
+
+        if (xbox_remote->buf_pool)
+            ru->buf = dma_pool_alloc(xbox_remote->buf_pool->pool, GFP_KERNEL,
+                                     &ru->buf_dma);
+        else
+            ru->buf = usb_alloc_coherent(udev, DATA_BUFSIZE, GFP_KERNEL,
+                                         &ru->buf_dma);
+        if (!ru->buf)
+            return -1;
+
+        ru->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!ru->urb)
+            return -1;
+    }
 
     return 0;
 }
@@ -362,10 +4043,22 @@ static int xbox_remote_alloc_buffers(struct usb_device *udev,
  */
 static void xbox_remote_free_buffers(struct xbox_remote *xbox_remote)
 {
-    usb_free_urb(xbox_remote->irq_urb);
+    unsigned int i;
+
+    for (i = 0; i < xbox_remote->num_urbs; i++) {
+        struct xbox_remote_urb *ru = &xbox_remote->ring[i];
 
-    usb_free_coherent(xbox_remote->udev, DATA_BUFSIZE,
-        xbox_remote->inbuf, xbox_remote->inbuf_dma);
+        usb_free_urb(ru->urb);
+        if (!ru->buf)
+            continue;
+        if (xbox_remote->buf_pool)
+            dma_pool_free(xbox_remote->buf_pool->pool, ru->buf, ru->buf_dma);
+        else
+            usb_free_coherent(xbox_remote->udev, DATA_BUFSIZE,
+                ru->buf, ru->buf_dma);
+    }
+
+    xbox_buf_pool_put(xbox_remote->buf_pool);
 }
 
 
@@ -385,29 +4078,61 @@ static void xbox_remote_rc_init(struct xbox_remote *xbox_remote)
 
     usb_to_input_id(xbox_remote->udev, &rdev->input_id);
     rdev->dev.parent = &xbox_remote->interface->dev;
+
+    /* rc-core adds EV_MSC/MSC_SCAN, key events also carry these */
+    __set_bit(MSC_TIMESTAMP, rdev->input_dev->mscbit);
+    __set_bit(MSC_RAW, rdev->input_dev->mscbit);
+    /* rc-core adds the keys of the keymap, gestures may send these */
+    xbox_remote_add_static_keys(rdev->input_dev);
 }
 
 static int xbox_remote_initialize(struct xbox_remote *xbox_remote)
 {
     struct usb_device *udev = xbox_remote->udev;
+    unsigned int i;
     int pipe, maxp;
 
     init_waitqueue_head(&xbox_remote->wait);
 
-    /* Set up irq_urb */
+    /* Set up the irq urb ring */
     pipe = usb_rcvintpipe(udev, xbox_remote->endpoint_in->bEndpointAddress);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    maxp = usb_maxpacket(udev, pipe);
+#else
     maxp = usb_maxpacket(udev, pipe, usb_pipeout(pipe));
+#endif
     maxp = (maxp > DATA_BUFSIZE) ? DATA_BUFSIZE : maxp;
 
-    usb_fill_int_urb(xbox_remote->irq_urb, udev, pipe, xbox_remote->inbuf,
-             maxp, xbox_remote_irq_in, xbox_remote,
-             xbox_remote->endpoint_in->bInterval);
-    xbox_remote->irq_urb->transfer_dma = xbox_remote->inbuf_dma;
-    xbox_remote->irq_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    for (i = 0; i < xbox_remote->num_urbs; i++) {
+        struct xbox_remote_urb *ru = &xbox_remote->ring[i];
+
+        usb_fill_int_urb(ru->urb, udev, pipe, ru->buf,
+                 maxp, xbox_remote_irq_in, ru,
+                 xbox_remote->endpoint_in->bInterval);
+        ru->urb->transfer_dma = ru->buf_dma;
+        ru->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    }
 
     return 0;
 }
 
+/*
+ * xbox_remote_timer_init
+ *
+ * hrtimer_setup() replaced hrtimer_init() in 6.13.
+ */
+static void xbox_remote_timer_init(struct hrtimer *timer,
+                enum hrtimer_restart (*function)(struct hrtimer *),
+                enum hrtimer_mode mode)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(timer, function, CLOCK_MONOTONIC, mode);
+#else
+    hrtimer_init(timer, CLOCK_MONOTONIC, mode);
+    timer->function = function;
+#endif
+}
+
 /*
  * xbox_remote_probe
  */
@@ -419,10 +4144,11 @@ static int xbox_remote_probe(struct usb_interface *interface,
     struct usb_endpoint_descriptor *endpoint_in;
     struct xbox_remote *xbox_remote;
     struct rc_dev *rc_dev;
+    const struct xbox_remote_variant *variant =
+        (const struct xbox_remote_variant *)id->driver_info;
+    struct rc_map_list *keymap;
     int err = -ENOMEM;
 
-    request_module("xbox_remote_keymap");
-    
     if (iface_host->desc.bNumEndpoints == 0) {
         return -ENODEV;
     }
@@ -448,12 +4174,13 @@ static int xbox_remote_probe(struct usb_interface *interface,
     if (!xbox_remote || !rc_dev)
         goto exit_free_dev_rdev;
 
+    xbox_remote->endpoint_in = endpoint_in;
+    xbox_remote->udev = udev;
+
     /* Allocate URB buffers, URBs */
     if (xbox_remote_alloc_buffers(udev, xbox_remote))
         goto exit_free_buffers;
 
-    xbox_remote->endpoint_in = endpoint_in;
-    xbox_remote->udev = udev;
     xbox_remote->rdev = rc_dev;
     xbox_remote->interface = interface;
 
@@ -471,30 +4198,120 @@ static int xbox_remote_probe(struct usb_interface *interface,
             le16_to_cpu(xbox_remote->udev->descriptor.idVendor),
             le16_to_cpu(xbox_remote->udev->descriptor.idProduct));
 
-    rc_dev->map_name = RC_MAP_XBOX; /* default map */
 
     xbox_remote_rc_init(xbox_remote);
     mutex_init(&xbox_remote->open_mutex);
+    spin_lock_init(&xbox_remote->ring_lock);
+    spin_lock_init(&xbox_remote->key_lock);
+    INIT_DELAYED_WORK(&xbox_remote->recover_work, xbox_remote_recover_work);
+    INIT_DELAYED_WORK(&xbox_remote->poll_work, xbox_remote_poll_work);
+    xbox_remote_timer_init(&xbox_remote->release_timer,
+                           xbox_remote_release_timer, HRTIMER_MODE_REL);
+    xbox_remote_timer_init(&xbox_remote->repeat_timer,
+                           xbox_remote_repeat_timer, HRTIMER_MODE_REL);
+    xbox_remote_timer_init(&xbox_remote->gesture_timer,
+                           xbox_remote_gesture_timer, HRTIMER_MODE_ABS);
 
     /* Device Hardware Initialization - fills in xbox_remote->idev from udev. */
     err = xbox_remote_initialize(xbox_remote);
     if (err)
         goto exit_kill_urbs;
 
+    /* Keys pressed poll at bInterval, an idle receiver at poll_slow */
+    xbox_remote->poll_fast_ms = xbox_remote->ring[0].urb->interval;
+    if (udev->speed >= USB_SPEED_HIGH)
+        xbox_remote->poll_fast_ms = max(xbox_remote->poll_fast_ms / 8, 1U);
+    xbox_remote->poll_fast_ms = min(xbox_remote->poll_fast_ms, 128U);
+    xbox_remote->poll_slow_ms = poll_slow ?
+        clamp(poll_slow, xbox_remote->poll_fast_ms, 128U) : 0;
+    xbox_remote->poll_fixed = xbox_remote_poll_fixed(udev);
+    if (xbox_remote->poll_fixed && xbox_remote->poll_slow_ms) {
+        dev_info(&interface->dev,
+            "host controller ignores the polling interval, poll_slow disabled\n");
+        xbox_remote->poll_slow_ms = 0;
+    }
+    xbox_remote->poll_idle_ms = clamp(poll_idle, 1U, 60000U);
+
+    err = xbox_remote_ring_init(xbox_remote);
+    if (err)
+        goto exit_kill_urbs;
+
+    if (threaded) {
+        err = xbox_remote_start_thread(xbox_remote);
+        if (err)
+            goto exit_kill_urbs;
+    }
+
+    /*
+     * A loaded rc-xbox module overrides the built-in map; hold a reference
+     * to it until rc-core has copied the table.
+     */
+    keymap = symbol_get(rc_xbox_map);
+    rc_dev->map_name = keymap ? RC_MAP_XBOX : variant->map->map.name;
+
     /* Set up and register rc device */
     err = rc_register_device(xbox_remote->rdev);
+    if (keymap)
+        symbol_put(rc_xbox_map);
     if (err)
         goto exit_kill_urbs;
-    
+
+    xbox_remote_keymap_init(xbox_remote);
+
+    /* Repeats of a held key come from input core autorepeat */
+    xbox_remote_calib_lookup(xbox_remote);
+    rc_dev->input_dev->rep[REP_DELAY] = calibrate && xbox_remote->calibrated ?
+        xbox_remote->rep_delay : repeat_delay;
+
+    if (channel_devices) {
+        err = xbox_remote_channels_init(xbox_remote);
+        if (err)
+            goto exit_unregister_device;
+    }
+
+    if (accel_pointer) {
+        err = xbox_remote_pointer_init(xbox_remote);
+        if (err)
+            goto exit_unregister_device;
+    }
+
+    if (xbox_aggregate_join(xbox_remote, xbox_aggregate_param_id(xbox_remote)))
+        dev_warn(&interface->dev, "could not join aggregate, reporting alone\n");
+
+    xbox_remote_debugfs_init(xbox_remote);
+
+    /* The device's autosuspend settings belong to the user otherwise */
+    if (autosuspend) {
+        pm_runtime_set_autosuspend_delay(&udev->dev, autosuspend_delay);
+        usb_enable_autosuspend(udev);
+    }
+
+    if (wakeup) {
+        if (device_can_wakeup(&udev->dev))
+            device_set_wakeup_enable(&udev->dev, true);
+        else
+            dev_info(&interface->dev, "receiver cannot wake the system\n");
+    }
+
     usb_set_intfdata(interface, xbox_remote);
     return 0;
 
  
 exit_unregister_device:
+    xbox_remote_poison_urbs(xbox_remote);
+    xbox_remote_stop_thread(xbox_remote);
+    xbox_remote_settle(xbox_remote);
+    xbox_aggregate_leave(xbox_remote);
+    xbox_remote_channels_exit(xbox_remote);
+    xbox_remote_pointer_exit(xbox_remote);
     rc_unregister_device(rc_dev);
     rc_dev = NULL;
  exit_kill_urbs:
-    usb_kill_urb(xbox_remote->irq_urb);
+    xbox_remote_poison_urbs(xbox_remote);
+    cancel_delayed_work_sync(&xbox_remote->recover_work);
+    cancel_delayed_work_sync(&xbox_remote->poll_work);
+    xbox_remote_stop_thread(xbox_remote);
+    xbox_remote_ring_exit(xbox_remote);
  exit_free_buffers:
     xbox_remote_free_buffers(xbox_remote);
  exit_free_dev_rdev:
@@ -503,6 +4320,128 @@ exit_unregister_device:
     return err;
 }
 
+/*
+ * xbox_remote_may_autosuspend
+ *
+ * An open receiver only autosuspends when waking it fits in wake_budget.
+ * Called with open_mutex held.
+ */
+static bool xbox_remote_may_autosuspend(struct xbox_remote *xbox_remote)
+{
+    long wakeups = atomic_long_read(&xbox_remote->stats.wakeups);
+    unsigned int budget = READ_ONCE(wake_budget);
+
+    if (!xbox_remote->users || !budget || !wakeups)
+        return true;
+
+    return atomic_long_read(&xbox_remote->stats.wakeup_usec) / wakeups <=
+           budget;
+}
+
+/*
+ * xbox_remote_suspend
+ */
+static int xbox_remote_suspend(struct usb_interface *interface,
+                pm_message_t message)
+{
+    struct xbox_remote *xbox_remote = usb_get_intfdata(interface);
+
+    mutex_lock(&xbox_remote->open_mutex);
+    if (PMSG_IS_AUTO(message)) {
+        if (!xbox_remote_may_autosuspend(xbox_remote)) {
+            mutex_unlock(&xbox_remote->open_mutex);
+            xbox_stat_inc(xbox_remote, runtime_vetoes);
+            return -EBUSY;
+        }
+        xbox_stat_inc(xbox_remote, runtime_suspends);
+    }
+
+    xbox_remote->suspended = true;
+    xbox_remote->suspend_start = ktime_get();
+    if (xbox_remote->users)
+        xbox_remote_disarm(xbox_remote);
+    mutex_unlock(&xbox_remote->open_mutex);
+
+    /* recover_work sees suspended and leaves the ring alone */
+    cancel_delayed_work(&xbox_remote->recover_work);
+
+    return 0;
+}
+
+/*
+ * xbox_remote_resume
+ *
+ * The device keeps no state of its own, so resuming comes down to
+ * submitting the ring again.
+ */
+static int xbox_remote_resume(struct usb_interface *interface)
+{
+    struct xbox_remote *xbox_remote = usb_get_intfdata(interface);
+    int err = 0;
+
+    mutex_lock(&xbox_remote->open_mutex);
+    xbox_remote->suspended = false;
+    atomic_long_add(ktime_us_delta(ktime_get(), xbox_remote->suspend_start),
+                    &xbox_remote->stats.suspended_usec);
+    if (xbox_remote->users && !xbox_remote_arm(xbox_remote)) {
+        dev_err(&interface->dev, "%s: usb_submit_urb failed!\n", __func__);
+        err = -EIO;
+    }
+    mutex_unlock(&xbox_remote->open_mutex);
+
+    return err;
+}
+
+/*
+ * xbox_remote_reset_resume
+ *
+ * After a reset, or a resume that lost the device state, check that the
+ * receiver still has the endpoint probe accepted; an error has the core
+ * rebind the driver. The filter forgets the packets from before, and the
+ * keycode table is rebuilt from the rc-core keymap.
+ */
+static int xbox_remote_reset_resume(struct usb_interface *interface)
+{
+    struct xbox_remote *xbox_remote = usb_get_intfdata(interface);
+    struct usb_host_interface *iface_host = interface->cur_altsetting;
+    struct usb_endpoint_descriptor *endpoint_in;
+    struct input_dev *idev = xbox_remote->rdev->input_dev;
+
+    endpoint_in = &iface_host->endpoint[0].desc;
+    if (iface_host->desc.bNumEndpoints != 1 ||
+        !usb_endpoint_is_int_in(endpoint_in) ||
+        endpoint_in->bEndpointAddress !=
+        xbox_remote->endpoint_in->bEndpointAddress ||
+        usb_endpoint_maxp(endpoint_in) !=
+        usb_endpoint_maxp(xbox_remote->endpoint_in)) {
+        dev_err(&interface->dev, "%s: endpoint changed\n", __func__);
+        return -ENODEV;
+    }
+    xbox_remote->endpoint_in = endpoint_in;
+
+    spin_lock_irq(&xbox_remote->key_lock);
+    xbox_remote_key_release(xbox_remote, ktime_get());
+    xbox_remote->old_data = 0;
+    xbox_remote->old_time = 0;
+    spin_unlock_irq(&xbox_remote->key_lock);
+
+    spin_lock_irq(&idev->event_lock);
+    xbox_remote_keymap_sync(xbox_remote);
+    spin_unlock_irq(&idev->event_lock);
+
+    return xbox_remote_resume(interface);
+}
+
+static int xbox_remote_pre_reset(struct usb_interface *interface)
+{
+    return xbox_remote_suspend(interface, PMSG_SUSPEND);
+}
+
+static int xbox_remote_post_reset(struct usb_interface *interface)
+{
+    return xbox_remote_reset_resume(interface);
+}
+
 /*
  * xbox_remote_disconnect
  */
@@ -517,7 +4456,17 @@ static void xbox_remote_disconnect(struct usb_interface *interface)
         return;
     }
 
-    usb_kill_urb(xbox_remote->irq_urb);
+    xbox_remote_poison_urbs(xbox_remote);
+    cancel_delayed_work_sync(&xbox_remote->recover_work);
+    cancel_delayed_work_sync(&xbox_remote->poll_work);
+    xbox_remote_stop_thread(xbox_remote);
+    xbox_remote_ring_exit(xbox_remote);
+    xbox_remote_settle(xbox_remote);
+    xbox_remote_calib_store(xbox_remote);
+    debugfs_remove_recursive(xbox_remote->debugfs);
+    xbox_aggregate_leave(xbox_remote);
+    xbox_remote_channels_exit(xbox_remote);
+    xbox_remote_pointer_exit(xbox_remote);
     rc_unregister_device(xbox_remote->rdev);
     xbox_remote_free_buffers(xbox_remote);
     kfree(xbox_remote);
@@ -528,10 +4477,65 @@ static struct usb_driver xbox_remote_driver = {
     .name         = "xbox_remote",
     .probe        = xbox_remote_probe,
     .disconnect   = xbox_remote_disconnect,
+    .suspend      = xbox_remote_suspend,
+    .resume       = xbox_remote_resume,
+    .reset_resume = xbox_remote_reset_resume,
+    .pre_reset    = xbox_remote_pre_reset,
+    .post_reset   = xbox_remote_post_reset,
+    .supports_autosuspend = 1,
     .id_table     = xbox_remote_table,
+    .dev_groups   = xbox_groups,
+    /* Nothing in probe needs to finish before boot moves on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    .driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#else
+    .drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 };
 
-module_usb_driver(xbox_remote_driver);
+static int __init xbox_remote_init(void)
+{
+    unsigned int i;
+    int err;
+
+    for (i = 0; i < ARRAY_SIZE(xbox_generated_maps); i++) {
+        err = rc_map_register(xbox_generated_maps[i]);
+        if (err)
+            goto exit_unregister_maps;
+    }
+
+    xbox_debugfs_root = debugfs_create_dir("xbox_remote", NULL);
+
+    err = usb_register(&xbox_remote_driver);
+    if (err) {
+        debugfs_remove_recursive(xbox_debugfs_root);
+        goto exit_unregister_maps;
+    }
+
+    return 0;
+
+exit_unregister_maps:
+    while (i--)
+        rc_map_unregister(xbox_generated_maps[i]);
+    return err;
+}
+
+static void __exit xbox_remote_exit(void)
+{
+    struct xbox_calib_entry *entry, *tmp;
+    unsigned int i;
+
+    usb_deregister(&xbox_remote_driver);
+    debugfs_remove_recursive(xbox_debugfs_root);
+    for (i = 0; i < ARRAY_SIZE(xbox_generated_maps); i++)
+        rc_map_unregister(xbox_generated_maps[i]);
+
+    list_for_each_entry_safe(entry, tmp, &xbox_calib_cache, list)
+        kfree(entry);
+}
+
+module_init(xbox_remote_init);
+module_exit(xbox_remote_exit);
 
 MODULE_AUTHOR(DRIVER_AUTHOR);
 MODULE_DESCRIPTION(DRIVER_DESC);
@@ -0,0 +1,80 @@
+/*
+ * Shared memory scancode ring of the XBox DVD remote driver
+ *
+ * Each receiver gets /dev/xbox_remoteN. With the ring_records module
+ * parameter set, mapping it read-only gives a struct xbox_ring_header in
+ * the first page followed by header.records struct xbox_ring_record
+ * entries; without it mmap() fails with ENODEV. The driver writes record
+ * (head % records) and then increments head; a record whose seq differs
+ * from the index the consumer expects has been overwritten. poll()
+ * reports POLLIN when head moved since the last poll.
+ *
+ * XBOX_IOC_SET_FILTER attaches a classic BPF program to the receiver,
+ * replacing the previous one; it needs CAP_SYS_ADMIN. The program runs
+ * on every well-formed packet with a struct xbox_filter_data as its
+ * packet, read with BPF_LD|BPF_W|BPF_ABS, and returns one of the
+ * XBOX_FILTER actions, optionally with XBOX_FILTER_REMAP and a new
+ * scancode. Any other value drops the packet. XBOX_IOC_CLEAR_FILTER
+ * detaches it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _XBOX_REMOTE_RING_H
+#define _XBOX_REMOTE_RING_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/filter.h>
+
+#define XBOX_RING_VERSION       1
+
+/* Filter verdict of a packet */
+#define XBOX_VERDICT_NEW        0   /* new press, keydown sent */
+#define XBOX_VERDICT_REPEAT     1   /* continuation of the held key */
+#define XBOX_VERDICT_MALFORMED  2   /* bad header, dropped */
+#define XBOX_VERDICT_UNMAPPED   3   /* no keycode for the scancode, dropped */
+#define XBOX_VERDICT_FILTERED   4   /* dropped by the packet filter */
+
+struct xbox_ring_header {
+    __u32 version;
+    __u32 record_size;
+    __u32 records;              /* power of 2 */
+    __u32 head;                 /* records written so far, wraps */
+};
+
+struct xbox_ring_record {
+    __s64 stamp_ns;             /* urb completion, CLOCK_MONOTONIC */
+    __u32 seq;                  /* value of head when written */
+    __u16 repeat_count;
+    __u8 scancode;
+    __u8 verdict;
+};
+
+struct xbox_filter_data {
+    __u32 scancode;
+    __u32 channel;
+    __u32 clock;
+    __u32 held;                 /* scancode of the held key, or XBOX_FILTER_NONE */
+    __u32 repeat_count;         /* repeats of the held key so far */
+    __u32 gap_usec;             /* since the previous packet, saturated */
+};
+
+#define XBOX_FILTER_NONE        0xffffffff
+
+/* Return value of a packet filter */
+#define XBOX_FILTER_ACTION      0xff000000
+#define XBOX_FILTER_DROP        0x00000000
+#define XBOX_FILTER_PASS        0x7f000000  /* the driver decides */
+#define XBOX_FILTER_NEW         0x7e000000  /* a new press */
+#define XBOX_FILTER_REPEAT      0x7d000000  /* the held key, dropped if none */
+#define XBOX_FILTER_REMAP       0x00010000  /* report scancode DATA instead */
+#define XBOX_FILTER_DATA        0x000000ff
+
+#define XBOX_IOC_SET_FILTER     _IOW('X', 0x01, struct sock_fprog)
+#define XBOX_IOC_CLEAR_FILTER   _IO('X', 0x02)
+
+#endif /* _XBOX_REMOTE_RING_H */
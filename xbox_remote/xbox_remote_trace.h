@@ -0,0 +1,170 @@
+/*
+ * Tracepoints for the XBox DVD remote input pipeline
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xbox_remote
+
+#if !defined(_XBOX_REMOTE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _XBOX_REMOTE_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+#include "xbox_remote_ring.h"
+
+/*
+ * Every event carries a ktime_get() stamp taken when it fires, so the
+ * latency of each stage is the difference between two stamps.
+ */
+
+TRACE_EVENT(xbox_remote_urb_complete,
+
+    TP_PROTO(unsigned int seq, int status, const unsigned char *data,
+             unsigned int len),
+
+    TP_ARGS(seq, status, data, len),
+
+    TP_STRUCT__entry(
+        __field(s64, ts)
+        __field(unsigned int, seq)
+        __field(int, status)
+        __field(unsigned int, len)
+        __field(u8, scancode)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_to_ns(ktime_get());
+        __entry->seq = seq;
+        __entry->status = status;
+        __entry->len = len;
+        __entry->scancode = len > 2 ? data[2] : 0;
+    ),
+
+    TP_printk("ts=%lld seq=%u status=%d len=%u scancode=%02x",
+              __entry->ts, __entry->seq, __entry->status, __entry->len,
+              __entry->scancode)
+);
+
+TRACE_EVENT(xbox_remote_header,
+
+    TP_PROTO(const unsigned char *data, unsigned int len, bool valid),
+
+    TP_ARGS(data, len, valid),
+
+    TP_STRUCT__entry(
+        __field(s64, ts)
+        __array(u8, data, 6)
+        __field(unsigned int, len)
+        __field(bool, valid)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_to_ns(ktime_get());
+        memset(__entry->data, 0, sizeof(__entry->data));
+        memcpy(__entry->data, data, min_t(unsigned int, len, 6));
+        __entry->len = len;
+        __entry->valid = valid;
+    ),
+
+    TP_printk("ts=%lld len=%u data=%*ph %s",
+              __entry->ts, __entry->len, 6, __entry->data,
+              __entry->valid ? "valid" : "malformed")
+);
+
+TRACE_EVENT(xbox_remote_filter,
+
+    TP_PROTO(u8 scancode, unsigned int repeat_count, int verdict),
+
+    TP_ARGS(scancode, repeat_count, verdict),
+
+    TP_STRUCT__entry(
+        __field(s64, ts)
+        __field(u8, scancode)
+        __field(unsigned int, repeat_count)
+        __field(int, verdict)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_to_ns(ktime_get());
+        __entry->scancode = scancode;
+        __entry->repeat_count = repeat_count;
+        __entry->verdict = verdict;
+    ),
+
+    TP_printk("ts=%lld scancode=%02x repeat_count=%u verdict=%s",
+              __entry->ts, __entry->scancode, __entry->repeat_count,
+              __print_symbolic(__entry->verdict,
+                               { XBOX_VERDICT_NEW, "new" },
+                               { XBOX_VERDICT_REPEAT, "repeat" },
+                               { XBOX_VERDICT_MALFORMED, "malformed" },
+                               { XBOX_VERDICT_UNMAPPED, "unmapped" },
+                               { XBOX_VERDICT_FILTERED, "filtered" }))
+);
+
+DECLARE_EVENT_CLASS(xbox_remote_key,
+
+    TP_PROTO(u8 scancode, unsigned int repeat_count),
+
+    TP_ARGS(scancode, repeat_count),
+
+    TP_STRUCT__entry(
+        __field(s64, ts)
+        __field(u8, scancode)
+        __field(unsigned int, repeat_count)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_to_ns(ktime_get());
+        __entry->scancode = scancode;
+        __entry->repeat_count = repeat_count;
+    ),
+
+    TP_printk("ts=%lld scancode=%02x repeat_count=%u",
+              __entry->ts, __entry->scancode, __entry->repeat_count)
+);
+
+DEFINE_EVENT(xbox_remote_key, xbox_remote_keydown,
+    TP_PROTO(u8 scancode, unsigned int repeat_count),
+    TP_ARGS(scancode, repeat_count)
+);
+
+DEFINE_EVENT(xbox_remote_key, xbox_remote_keyup,
+    TP_PROTO(u8 scancode, unsigned int repeat_count),
+    TP_ARGS(scancode, repeat_count)
+);
+
+TRACE_EVENT(xbox_remote_resubmit_error,
+
+    TP_PROTO(unsigned int seq, int retval),
+
+    TP_ARGS(seq, retval),
+
+    TP_STRUCT__entry(
+        __field(s64, ts)
+        __field(unsigned int, seq)
+        __field(int, retval)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_to_ns(ktime_get());
+        __entry->seq = seq;
+        __entry->retval = retval;
+    ),
+
+    TP_printk("ts=%lld seq=%u retval=%d",
+              __entry->ts, __entry->seq, __entry->retval)
+);
+
+#endif /* _XBOX_REMOTE_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE xbox_remote_trace
+#include <trace/define_trace.h>
@@ -35,7 +35,7 @@ static struct rc_map_table xbox[] = {
 
 };
 
-static struct rc_map_list xbox_map = {
+struct rc_map_list rc_xbox_map = {
 	.map = {
 		.scan     = xbox,
 		.size     = ARRAY_SIZE(xbox),
@@ -43,15 +43,16 @@ static struct rc_map_list xbox_map = {
 		.name     = RC_MAP_XBOX,
 	}
 };
+EXPORT_SYMBOL_GPL(rc_xbox_map);
 
 static int __init init_rc_map_xbox(void)
 {
-	return rc_map_register(&xbox_map);
+	return rc_map_register(&rc_xbox_map);
 }
 
 static void __exit exit_rc_map_xbox(void)
 {
-	rc_map_unregister(&xbox_map);
+	rc_map_unregister(&rc_xbox_map);
 }
 
 module_init(init_rc_map_xbox)
@@ -1 +1,4 @@
 #define RC_MAP_XBOX                      "rc-xbox"
+
+/* Exported by xbox_remote_keymap, looked up with symbol_get() */
+extern struct rc_map_list rc_xbox_map;